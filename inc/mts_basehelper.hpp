@@ -26,6 +26,15 @@ enum BGFeature {Colordiff=0, Distracttext, Boundary, Colorblob,
                 Straight, Grid, Citypoint, Parallel, 
                 Vparallel, Texture, Railroad, Riverline};
 
+// The number of possible background features
+const int NUM_BG_FEATURES = Riverline + 1;
+
+// A set of background features; bit i is set if BGFeature i is present
+typedef unsigned int BGFeatureMask;
+
+// Returns the mask containing only the feature f
+inline BGFeatureMask featureBit(BGFeature f) { return 1u << f; }
+
 // rename pair of doubles for readability as coordinates (x,y)
 typedef std::pair<double, double> coords;
 
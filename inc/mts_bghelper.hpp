@@ -2,6 +2,7 @@
 #define MTS_BACKGROUND_HELPER_HPP
 
 #include <vector>
+#include <chrono>
 
 #include <pango/pangocairo.h>
 
@@ -32,6 +33,76 @@ class MTS_BackgroundHelper {
         beta_distribution<> texture_distribution;
         variate_generator<mt19937, beta_distribution<> > texture_distrib_gen;
 
+        /* The probability of each background feature, indexed by BGFeature */
+        double feature_probs[NUM_BG_FEATURES];
+
+        /* Features with a nonzero probability, in BGFeature order */
+        vector<BGFeature> candidate_features;
+
+        /* The max number of features in one background */
+        int max_num_features;
+
+        /* Time budget for drawing one background in microseconds
+         * (0 means no budget). Which features fit depends on measured
+         * drawing times, so with a budget a seed no longer determines the
+         * samples that follow it. */
+        double bg_time_budget_us;
+
+        /* Whether plain straight lines are drawn with draw_straight_line
+         * rather than stroked by cairo (off unless configured) */
+        bool direct_lines;
+
+        /* Running estimate of a drawing cost */
+        struct CostEstimate {
+            double cost;  // microseconds per pixel
+            int timings;  // number of timings folded into cost
+            int drops;    // backgrounds left out of in a row
+        };
+
+        /* Cost estimates of each feature, indexed by BGFeature */
+        CostEstimate feature_costs[NUM_BG_FEATURES];
+
+        /* Cost estimate of the plain background and bias field */
+        CostEstimate base_cost;
+
+        /*
+         * Removes the features with the highest estimated cost from features
+         * until the estimated cost of the background fits in
+         * bg_time_budget_us. Features timed fewer than COST_WARMUP_TIMINGS
+         * times are always kept, and so is a feature left out of
+         * COST_PROBE_INTERVAL backgrounds in a row, to time it again.
+         * Returns the remaining features.
+         *
+         * features - the features selected for the background
+         * width - surface width in pixels
+         * height - surface height in pixels
+         */
+        BGFeatureMask
+            fitTimeBudget(BGFeatureMask features, int width, int height);
+
+        /* Number of timings averaged before an estimate is trusted */
+        static constexpr int COST_WARMUP_TIMINGS = 8;
+
+        /* Weight of a new timing in the running cost estimates, after the
+         * warmup */
+        static constexpr double COST_SMOOTHING = 0.05;
+
+        /* Backgrounds a feature may be left out of in a row before it is
+         * drawn (and timed) again regardless of the budget */
+        static constexpr int COST_PROBE_INTERVAL = 200;
+
+        /*
+         * Folds a measured drawing time into a running cost estimate
+         *
+         * est - the estimate to update
+         * elapsed - the measured drawing time
+         * pixels - the number of pixels in the surface
+         */
+        static void
+            update_cost(CostEstimate &est,
+                        std::chrono::steady_clock::duration elapsed,
+                        double pixels);
+
   
         /*
          * Makes a thicker line behind the original that is a different 
@@ -315,10 +386,39 @@ class MTS_BackgroundHelper {
                     int height, double c_min=0, double c_max=0, 
                     double d_min=0, double d_max=0, double color=0);
 
+        /*
+         * Draws a solid straight line with draw_straight_line if
+         * direct_lines is set, and with cairo_stroke otherwise
+         *
+         * cr - cairo context
+         * x1, y1 - line start in user space
+         * x2, y2 - line end in user space
+         * linewidth - width of the line in user space
+         */
+        void
+            add_straight_line(cairo_t *cr, double x1, double y1,
+                              double x2, double y2, double linewidth);
+
+
+        /* Number of profile samples between two bias color stops */
+        static const int BIAS_PROFILE_STEPS = 64;
+
+        /*
+         * Samples a gradient of evenly spaced color stops into a dense
+         * lookup table with BIAS_PROFILE_STEPS entries between stops
+         *
+         * profile - the output table of gray values (0-255)
+         * stops - the gray values (0-255) of the color stops
+         *         (must contain at least 2 stops)
+         */
+        static void
+            bias_profile(vector<float> &profile, vector<double> &stops);
+
 
         /*
          * Makes the background variably colored to simulate
-         * stained or worn map paper
+         * stained or worn map paper. The two gradients of the bias field are
+         * blended straight into the pixel data of the surface in one pass.
          *
          * cr - cairo context
          * width - width of canvas
@@ -385,26 +485,59 @@ class MTS_BackgroundHelper {
         ~MTS_BackgroundHelper();
 
         /*
-         * Generate bg features that will be drawn on current image
-         * basing on the probabilities the user gives
+         * Draws a solid straight line of uniform width with butt caps
+         * directly into the pixel data of the surface targeted by cr,
+         * without building a cairo path. Coverage is box filtered across the
+         * width and at the caps, so it matches cairo_stroke to within
+         * rounding, and only the span of each row that the line crosses is
+         * visited. Falls back to cairo_stroke unless the target is an ARGB32
+         * image surface, the source a solid color, the operator OVER, the
+         * line cap BUTT and the clip at most one pixel aligned rectangle.
          *
-         * bg_features - the ouput array of features
+         * cr - cairo context (its current matrix, source, operator, line cap
+         *      and clip are used, the path is left alone)
+         * x1 - x position of the line start in user space
+         * y1 - y position of the line start in user space
+         * x2 - x position of the line end in user space
+         * y2 - y position of the line end in user space
+         * linewidth - width of the line in user space
          */
-        void
-            generateBgFeatures(vector<BGFeature> &bg_features);
+        static void
+            draw_straight_line(cairo_t *cr, double x1, double y1,
+                               double x2, double y2, double linewidth);
 
         /*
-         * Generates a map-like background 
+         * Reseeds the engines of the background distribution generators
+         *
+         * seed - the seed to use
+         */
+        void setSeed(uint64 seed);
+
+        /*
+         * Generate bg features that will be drawn on current image
+         * basing on the probabilities the user gives. Returns the set
+         * of features as a mask.
+         */
+        BGFeatureMask
+            generateBgFeatures();
+
+        /*
+         * Generates a map-like background. If bg_time_budget_us is set,
+         * the most expensive features are left out so that the background
+         * stays within the budget (see fitTimeBudget), at the cost of
+         * reproducibility.
          *
          * bg_surface - the image surface
-         * features - the list of features to be added
+         * features - the set of features to be added. On return it holds
+         *            the features that were actually drawn.
+         * height - surface height in pixels
          * width - surface width in pixels
          * bg_color - the grayscale color value for the background
          * contrast - the contrast level
          */
         void
             generateBgSample(cairo_surface_t *&bg_surface,
-                             vector<BGFeature>&features, int height,
+                             BGFeatureMask &features, int height,
                              int width, int bg_color, int contrast);
 };
 
@@ -87,6 +87,24 @@ public://-----------------PUBLIC METHODS AND FIELDS------------------------
         void generateSample(string &caption, Mat &sample,
                             int &actual_height);
 
+        /*
+         * Generate a sample image and report its metadata
+         *
+         * caption - the text displayed in the image
+         * sample - the opencv matrix that actually contains the image data
+         * actual_height - the actual height of sample in pixels. 
+         * info - the metadata of the sample (e.g. its background features)
+         */
+        void generateSample(string &caption, Mat &sample,
+                            int &actual_height, MTSSampleInfo &info);
+
+        /*
+         * Reseed all random number generators
+         *
+         * seed - the seed to use
+         */
+        void setSeed(uint64 seed);
+
 };
 
 #endif
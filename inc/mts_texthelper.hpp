@@ -4,6 +4,8 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <map>
+#include <list>
 
 #include <pango/pangocairo.h>
 
@@ -18,6 +20,31 @@ using boost::random::beta_distribution;
 using boost::random::gamma_distribution;
 using boost::random::variate_generator;
 
+/*
+ * A pre-rendered string of random characters that distractor text is
+ * cropped from
+ */
+struct DistractSprite {
+    /* An A8 mask holding the rendered characters */
+    cairo_surface_t *surface;
+
+    /* The x position of each character boundary in the mask */
+    vector<int> char_x;
+
+    /* The height of the mask */
+    int height;
+};
+
+/*
+ * The distractor sprites of one font
+ */
+struct DistractFont {
+    vector<DistractSprite> sprites;
+
+    /* The position of the font in the recently used list */
+    std::list<string>::iterator lru;
+};
+
 /*
  * A class to handle text transformation in vector space, and pango
  * text rendering 
@@ -78,17 +105,56 @@ private:// --------------- PRIVATE METHODS AND FIELDS ------------------------
         char
             randomDigit();
 
+        /* Number of distractor font size buckets per doubling of size */
+        static const int DISTRACT_SIZE_BUCKETS = 4;
+
+        /* Length of a distractor sprite w.r.t. distract_len_max */
+        static const int DISTRACT_SPRITE_REPEAT = 4;
+
+        /* The max number of sprites kept for each distractor font */
+        int distract_bank_size;
+
+        /* The max number of bytes all distractor sprites may take */
+        size_t distract_bank_budget;
+
+        /* The number of bytes the distractor sprites take */
+        size_t distract_bank_bytes;
+
+        /* Pre-rendered distractor sprites, keyed by font string */
+        std::map<string, DistractFont> distract_bank;
+
+        /* The fonts of distract_bank, most recently used first */
+        std::list<string> distract_lru;
+
+        /*
+         * Frees the sprites of the least recently used distractor font
+         */
+        void
+            evictDistractFont();
+
+        /*
+         * Renders a string of random characters into a new sprite
+         *
+         * sprite - the output
+         * font - cstring holding the font to render with
+         */
+        void
+            renderDistractSprite(DistractSprite &sprite, const char *font);
+
         /*
          * Generates distractor text with random size and rotation to appear
-         * on the surface along with the main text
+         * on the surface along with the main text. The text is a random crop
+         * of a sprite from the distractor bank, which is filled up lazily
+         * for each font and size bucket. Fonts that have not been used for
+         * the longest are evicted to keep the bank within its budget.
          *
          * cr - cairo context
          * width - surface width
          * height - surface height
-         * font - cstring holding the desired font for the distractor text
+         * fontsize - the size of the distractor text
          */
         void
-            distractText (cairo_t *cr, int width, int height, char *font); 
+            distractText (cairo_t *cr, int width, int height, int fontsize); 
 
 
         /*
@@ -227,6 +293,13 @@ public:// --------------------- PUBLIC METHODS -------------------------------
         /* Destructor */
         ~MTS_TextHelper();
 
+        /*
+         * Reseeds the engines of the text distribution generators
+         *
+         * seed - the seed to use
+         */
+        void setSeed(uint64 seed);
+
         
         /*
          * Provides the randomly rendered text 
@@ -5,6 +5,27 @@
 #include <memory>
 #include <opencv2/core/mat.hpp> //cv::Mat
 
+/*
+ * Metadata describing how a sample was synthesized
+ */
+struct MTSSampleInfo {
+    /*
+     * The background features present in the sample. Bit i is set if
+     * feature i was drawn, where the features are numbered:
+     *  0 - color difference  1 - distractor text  2 - boundary lines
+     *  3 - color blobs       4 - straight lines   5 - grid
+     *  6 - city point        7 - parallel lines   8 - varied parallel lines
+     *  9 - texture          10 - railroad        11 - river
+     */
+    unsigned int bg_features;
+
+    /*
+     * The background features that were selected for the sample but left
+     * out to keep it within bg_time_budget_us (same numbering as above)
+     */
+    unsigned int dropped_bg_features;
+};
+
 /*
  * Class that renders synthetic text images for training a CNN 
  * on word recognition in historical maps
@@ -42,6 +63,39 @@ class MapTextSynthesizer{
          * The destructor for the MapTextSynthesizer class 
          */ 
         virtual ~MapTextSynthesizer(){}
+
+        /*
+         * Same as generateSample above, and also reports how the sample
+         * was synthesized. Declared after the destructor so the vtable of
+         * older builds stays a prefix of this one; synthesizers that don't
+         * override it report no background features.
+         *
+         * caption - the label of the image. 
+         * sample - the resulting text sample.
+         * actual_height - the actual height of sample.
+         * info - the metadata of the sample.
+         */
+        virtual void 
+            generateSample (std::string &caption, cv::Mat &sample, 
+                    int &actual_height, MTSSampleInfo &info) {
+                info.bg_features = 0;
+                info.dropped_bg_features = 0;
+                generateSample(caption, sample, actual_height);
+            }
+
+        /*
+         * Reseeds all random number generators of the synthesizer, so
+         * that the samples that follow are determined by seed
+         *
+         * seed - the seed to use
+         * (declared last, for the same reason as the overload above;
+         * synthesizers that don't override it ignore the seed and keep
+         * their own seeding, so their samples can't be reproduced)
+         */
+        virtual void
+            setSeed(uint64 seed) {
+                (void)seed;
+            }
 };
 
 #endif // MAP_TEXT_SYNTHESIZER_HPP
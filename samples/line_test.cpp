@@ -0,0 +1,142 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Checks the direct line rasterizer of the background helper against cairo.  *
+ *                                                                            *
+ * Copyright (C) 2018, Liam Niehus-Staab and Ziwen Chen                       *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <pango/pangocairo.h>
+
+#include "mts_bghelper.hpp"
+
+using namespace std;
+
+#define SIZE 64
+
+// largest difference allowed in any one channel of any one pixel (the two
+// rasterizers disagree slightly at the corners of the butt caps)
+#define MAX_PIXEL_DIFF 16
+
+// largest difference allowed in the total ink of a line, in percent
+#define MAX_INK_DIFF 5.0
+
+/*
+ * Draws the same line into two fresh surfaces, once with cairo_stroke and
+ * once with draw_straight_line, and compares them. Returns false and
+ * reports the line if they differ by more than the limits above.
+ *
+ * width - line width in user space
+ * angle - rotation of the line in radians
+ * scale - uniform scale of the user space
+ * alpha - alpha of the source color
+ */
+bool compare(double width, double angle, double scale, double alpha) {
+    cairo_surface_t *surfaces[2];
+    double ink[2] = {0, 0};
+
+    for (int k = 0; k < 2; k++) {
+        surfaces[k] = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                SIZE, SIZE);
+        cairo_t *cr = cairo_create(surfaces[k]);
+
+        // an opaque background, so the blend with it gets checked too
+        cairo_set_source_rgb(cr, 0.2, 0.4, 0.6);
+        cairo_paint(cr);
+
+        // line centered off the pixel grid, as in the background helper
+        cairo_translate(cr, SIZE/2 + 0.3, SIZE/2 - 0.2);
+        cairo_rotate(cr, angle);
+        cairo_scale(cr, scale, scale);
+        cairo_set_source_rgba(cr, 0.9, 0.1, 0.3, alpha);
+        cairo_set_line_cap(cr, CAIRO_LINE_CAP_BUTT);
+
+        double half = SIZE / (3 * scale);
+        if (k == 0) {
+            cairo_move_to(cr, -half, 0);
+            cairo_line_to(cr, half, 0);
+            cairo_set_line_width(cr, width);
+            cairo_stroke(cr);
+        } else {
+            MTS_BackgroundHelper::draw_straight_line(cr, -half, 0, half, 0,
+                    width);
+        }
+        cairo_destroy(cr);
+        cairo_surface_flush(surfaces[k]);
+    }
+
+    unsigned char *expect = cairo_image_surface_get_data(surfaces[0]);
+    unsigned char *actual = cairo_image_surface_get_data(surfaces[1]);
+    int stride = cairo_image_surface_get_stride(surfaces[0]);
+    int worst = 0;
+
+    for (int y = 0; y < SIZE; y++) {
+        for (int x = 0; x < 4*SIZE; x++) {
+            int e = expect[y*stride + x], a = actual[y*stride + x];
+            worst = max(worst, abs(e - a));
+            // distance from the background in the red channel (B,G,R,A)
+            if (x % 4 == 2) {
+                ink[0] += abs(e - 51);
+                ink[1] += abs(a - 51);
+            }
+        }
+    }
+
+    cairo_surface_destroy(surfaces[0]);
+    cairo_surface_destroy(surfaces[1]);
+
+    double ink_diff = 100 * fabs(ink[1] - ink[0]) / max(ink[0], 1.0);
+    if (worst > MAX_PIXEL_DIFF || ink_diff > MAX_INK_DIFF) {
+        cerr << "width " << width << " angle " << angle << " scale "
+             << scale << " alpha " << alpha << ": max pixel diff " << worst
+             << ", ink diff " << ink_diff << "%" << endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Compares draw_straight_line against cairo_stroke for sub-pixel and
+ * fractional widths at a range of angles, scales and alphas. Exits with
+ * status 1 if any line differs by more than the limits above.
+ *
+ * Example usage :
+ * ./mts_line_test
+ */
+int main() {
+    double widths[] = {0.2, 0.5, 0.8, 1.0, 1.3, 2.7, 5.5};
+    double scales[] = {1.0, 0.7, 1.6};
+    double alphas[] = {1.0, 0.4};
+    int failed = 0, total = 0;
+
+    for (double width : widths) {
+        for (double scale : scales) {
+            for (double alpha : alphas) {
+                for (int k = 0; k < 16; k++) {
+                    total++;
+                    if (!compare(width, k * M_PI / 16 + 0.05, scale, alpha)) {
+                        failed++;
+                    }
+                }
+            }
+        }
+    }
+
+    cout << total - failed << "/" << total << " lines match cairo_stroke"
+         << endl;
+    return failed > 0;
+}
@@ -0,0 +1,117 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * A soak test for the MapTextSynthesizer class, to catch memory leaks.       *
+ *                                                                            *
+ * Copyright (C) 2018, Liam Niehus-Staab and Ziwen Chen                       *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * **/
+
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>   // mallinfo
+#include <unistd.h>   // sysconf
+#include <opencv2/opencv.hpp>
+
+// header to include for using the synthesizer
+#include "mtsynth/map_text_synthesizer.hpp"
+
+using namespace std;
+using namespace cv;
+
+#define DEFAULT_ROUNDS 100000
+#define REPORT_RATE 10000
+
+// samples generated before the baseline is taken (fills font caches etc.)
+#define WARMUP_ROUNDS 10000
+
+// growth past the baseline that counts as a leak. The distractor bank may
+// keep filling up to its budget after the warmup (distract_bank_mb in
+// config.txt, 16 by default), the rest is headroom for the other caches
+#define MAX_GROWTH_MB 32
+
+/* Resident set size of this process in MB */
+double rssMB() {
+    unsigned long size, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return (double)resident * sysconf(_SC_PAGESIZE) / 1048576;
+}
+
+/* Bytes currently allocated with malloc, in MB */
+double heapMB() {
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+    return (double)mallinfo2().uordblks / 1048576;
+#else
+    // wraps past 4 GB
+    return (double)(unsigned)mallinfo().uordblks / 1048576;
+#endif
+}
+
+/*
+ * Generates a large number of samples with a fixed seed, printing RSS and
+ * malloc'd heap size every REPORT_RATE samples. Exits with status 1 if
+ * either grew by more than MAX_GROWTH_MB after the warmup.
+ *
+ * Example usage :
+ * ./mts_soak_test               (100000 samples, seed 1)
+ * ./mts_soak_test 1000000 42
+ */
+int main(int argc, char **argv) {
+    long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+    uint64 seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+
+    auto mts = MapTextSynthesizer::create("config.txt");
+    mts->setSeed(seed);
+
+    string label;
+    Mat image;
+    int height;
+    double base_rss = 0, base_heap = 0;
+
+    cout << "samples\trss_mb\theap_mb" << endl;
+    for (long k = 1; k <= rounds; k++) {
+        mts->generateSample(label, image, height);
+
+        if (k == WARMUP_ROUNDS) {
+            base_rss = rssMB();
+            base_heap = heapMB();
+        }
+        if (k % REPORT_RATE == 0) {
+            cout << k << "\t" << rssMB() << "\t" << heapMB() << endl;
+        }
+    }
+
+    if (rounds < WARMUP_ROUNDS) {
+        cout << "Too few samples to compare against a baseline" << endl;
+        return 0;
+    }
+
+    double rss_growth = rssMB() - base_rss;
+    double heap_growth = heapMB() - base_heap;
+    cout << "Growth after warmup: rss " << rss_growth << " MB, heap "
+         << heap_growth << " MB" << endl;
+
+    if (rss_growth > MAX_GROWTH_MB || heap_growth > MAX_GROWTH_MB) {
+        cerr << "Memory grew by more than " << MAX_GROWTH_MB << " MB" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <vector>
 #include <iostream>
+#include <chrono>
 
 
 #include <pango/pangocairo.h>
@@ -45,6 +46,9 @@ using boost::random::normal_distribution;
 using boost::random::gamma_distribution;
 using boost::random::variate_generator;
 
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
 
 // SEE mts_bghelper.hpp FOR ALL DOCUMENTATION
 
@@ -59,12 +63,49 @@ MTS_BackgroundHelper::MTS_BackgroundHelper(shared_ptr<MTS_BaseHelper> h,
     texture_distribution(c->getParamDouble("texture_width_alpha"), 
             c->getParamDouble("texture_width_beta")),
     texture_distrib_gen(h->rng2_, texture_distribution)
-{}
+{
+    // get probabilities of all bg features (indexed by BGFeature)
+    const char *prob_names[NUM_BG_FEATURES] = {"diff_prob", "distract_prob",
+        "boundary_prob", "blob_prob", "straight_prob", "grid_prob",
+        "point_prob", "para_prob", "vpara_prob", "texture_prob",
+        "railroad_prob", "river_prob"};
+
+    // features that can never appear are left out of the sampling
+    for (int i = 0; i < NUM_BG_FEATURES; i++) {
+        feature_probs[i] = config->getParamDouble(prob_names[i]);
+        if (feature_probs[i] > 0) {
+            candidate_features.push_back(static_cast<BGFeature>(i));
+        }
+    }
+    max_num_features = config->getParamDouble("max_num_features");
+
+    // the time budget is optional, and off unless configured
+    bg_time_budget_us = 0;
+    if (config->findParam("bg_time_budget_us")) {
+        bg_time_budget_us = config->getParamDouble("bg_time_budget_us");
+    }
+
+    // the direct line rasterizer is opt-in until checked against cairo
+    direct_lines = false;
+    if (config->findParam("direct_lines")) {
+        direct_lines = config->getParamDouble("direct_lines") != 0;
+    }
+    CostEstimate untimed = {0, 0, 0};
+    std::fill(feature_costs, feature_costs + NUM_BG_FEATURES, untimed);
+    base_cost = untimed;
+}
 
 
 MTS_BackgroundHelper::~MTS_BackgroundHelper(){
 }
 
+void
+MTS_BackgroundHelper::setSeed(uint64 seed) {
+    // offset the seeds so the generators don't share one stream
+    bias_var_gen.engine().seed((uint32_t)(seed + 3));
+    texture_distrib_gen.engine().seed((uint32_t)(seed + 4));
+}
+
 void
 MTS_BackgroundHelper::draw_boundary(cairo_t *cr, double linewidth,
         double og_col) {
@@ -181,6 +222,181 @@ MTS_BackgroundHelper::orient_path(cairo_t *cr, bool curved,
     cairo_translate(cr, -length/2.0, -height);
 }
 
+/*
+ * Cumulative distribution of the distance of a random point of a pixel from
+ * its center, measured along the unit direction (ux, uy). The pixel projects
+ * onto that direction as a trapezoid.
+ */
+static double
+pixel_footprint(double x, double ux, double uy) {
+    double a = max(fabs(ux), fabs(uy)), b = min(fabs(ux), fabs(uy));
+    double y = x + (a + b) / 2;
+
+    if (y <= 0) return 0;
+    if (y >= a + b) return 1;
+    if (y < b) return y*y / (2*a*b);
+    if (y > a) return 1 - (a+b-y)*(a+b-y) / (2*a*b);
+    return (y - b/2) / a;
+}
+
+/*
+ * Fraction of a pixel whose center is at distance d from the middle of a
+ * segment of half length half (both measured along the unit direction
+ * (ux, uy)) that lies within the segment
+ */
+static double
+pixel_coverage(double d, double half, double ux, double uy) {
+    return pixel_footprint(half - d, ux, uy) -
+        pixel_footprint(-half - d, ux, uy);
+}
+
+/*
+ * The device space rectangle that the clip of cr is, if it is a single
+ * pixel aligned one (or no clip at all). Returns false otherwise.
+ */
+static bool
+clip_rectangle(cairo_t *cr, int width, int height,
+        int *x0, int *y0, int *x1, int *y1) {
+
+    // clip rectangles come back in user space, so use device space
+    cairo_matrix_t m;
+    cairo_get_matrix(cr, &m);
+    cairo_identity_matrix(cr);
+    cairo_rectangle_list_t *clip = cairo_copy_clip_rectangle_list(cr);
+    cairo_set_matrix(cr, &m);
+
+    bool ok = false;
+    if (clip->status == CAIRO_STATUS_SUCCESS && clip->num_rectangles == 1) {
+        cairo_rectangle_t r = clip->rectangles[0];
+        ok = r.x == floor(r.x) && r.y == floor(r.y) &&
+            r.width == floor(r.width) && r.height == floor(r.height);
+        *x0 = max(0, (int)r.x);
+        *y0 = max(0, (int)r.y);
+        *x1 = min(width, (int)(r.x + r.width));
+        *y1 = min(height, (int)(r.y + r.height));
+    }
+    cairo_rectangle_list_destroy(clip);
+    return ok;
+}
+
+void
+MTS_BackgroundHelper::add_straight_line(cairo_t *cr, double x1, double y1,
+        double x2, double y2, double linewidth) {
+    if (direct_lines) {
+        draw_straight_line(cr, x1, y1, x2, y2, linewidth);
+        return;
+    }
+    cairo_move_to(cr, x1, y1);
+    cairo_line_to(cr, x2, y2);
+    cairo_set_line_width(cr, linewidth);
+    cairo_stroke(cr);
+}
+
+void
+MTS_BackgroundHelper::draw_straight_line(cairo_t *cr, double x1, double y1,
+        double x2, double y2, double linewidth) {
+
+    cairo_surface_t *surface = cairo_get_target(cr);
+    double r, g, b, a;
+    int clip_x0 = 0, clip_y0 = 0, clip_x1 = 0, clip_y1 = 0;
+
+    // only butt capped, solid sources drawn OVER an ARGB32 image surface,
+    // clipped to at most a pixel aligned rectangle, can be written directly
+    if (cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE ||
+            cairo_image_surface_get_format(surface) != CAIRO_FORMAT_ARGB32 ||
+            cairo_get_operator(cr) != CAIRO_OPERATOR_OVER ||
+            cairo_get_line_cap(cr) != CAIRO_LINE_CAP_BUTT ||
+            cairo_pattern_get_rgba(cairo_get_source(cr), &r, &g, &b, &a)
+            != CAIRO_STATUS_SUCCESS ||
+            !clip_rectangle(cr, cairo_image_surface_get_width(surface),
+                cairo_image_surface_get_height(surface),
+                &clip_x0, &clip_y0, &clip_x1, &clip_y1)) {
+        cairo_move_to(cr, x1, y1);
+        cairo_line_to(cr, x2, y2);
+        cairo_set_line_width(cr, linewidth);
+        cairo_stroke(cr);
+        return;
+    }
+
+    // map the line into device space (lines are only rotated & translated,
+    // so the width is scaled by the uniform scale of the matrix)
+    cairo_matrix_t m;
+    cairo_get_matrix(cr, &m);
+    double half_width = linewidth * sqrt(fabs(m.xx*m.yy - m.xy*m.yx)) / 2;
+    cairo_user_to_device(cr, &x1, &y1);
+    cairo_user_to_device(cr, &x2, &y2);
+
+    double length = sqrt(pow(x2-x1,2) + pow(y2-y1,2));
+    if (length == 0 || half_width == 0) return;
+    double half_length = length / 2;
+
+    // unit vectors along (u) and across (n) the line
+    double ux = (x2-x1) / length, uy = (y2-y1) / length;
+    double nx = -uy, ny = ux;
+
+    int stride = cairo_image_surface_get_stride(surface);
+
+    // premultiplied source pixel in cairo's B,G,R,A byte order
+    double src[4] = {b*a*255, g*a*255, r*a*255, a*255};
+
+    cairo_surface_flush(surface);
+    unsigned char *data = cairo_image_surface_get_data(surface);
+
+    // pixels reaching across the line edges get partial coverage
+    double reach = (fabs(ux) + fabs(uy)) / 2;
+    double across = half_width + reach;
+    double along = half_length + reach;
+
+    for (int row = clip_y0; row < clip_y1; row++) {
+        // distances of the pixel center at column 0 from the line's center,
+        // along (s) and across (t) it
+        double dy = row + 0.5 - (y1 + y2) / 2;
+        double dx = 0.5 - (x1 + x2) / 2;
+        double s0 = dx*ux + dy*uy;
+        double t0 = dx*nx + dy*ny;
+
+        // intersect the slabs |s| <= along and |t| <= across to find the
+        // span of columns this row needs to visit
+        double lo = clip_x0, hi = clip_x1 - 1;
+        if (ux != 0) {
+            double a1 = (-along - s0) / ux, a2 = (along - s0) / ux;
+            lo = max(lo, min(a1,a2));
+            hi = min(hi, max(a1,a2));
+        } else if (fabs(s0) > along) {
+            continue;
+        }
+        if (nx != 0) {
+            double a1 = (-across - t0) / nx, a2 = (across - t0) / nx;
+            lo = max(lo, min(a1,a2));
+            hi = min(hi, max(a1,a2));
+        } else if (fabs(t0) > across) {
+            continue;
+        }
+        if (lo > hi) continue;
+
+        unsigned char *pixel = data + row*stride + 4*(int)ceil(lo);
+        for (int col = (int)ceil(lo); col <= (int)floor(hi); col++) {
+            double s = s0 + col*ux;
+            double t = t0 + col*nx;
+
+            // area coverage across the width times that along the length
+            // (exact except in the corners of the butt caps)
+            double cov = pixel_coverage(t, half_width, ux, uy) *
+                pixel_coverage(s, half_length, ux, uy);
+            if (cov > 0) {
+                // OVER with premultiplied alpha
+                for (int c = 0; c < 4; c++) {
+                    pixel[c] = (unsigned char)(src[c]*cov +
+                            pixel[c]*(1 - a*cov) + 0.5);
+                }
+            }
+            pixel += 4;
+        }
+    }
+
+    cairo_surface_mark_dirty(surface);
+}
+
 void
 MTS_BackgroundHelper::generate_curve(cairo_t *cr, int width, int height,
         double c_min, double c_max, double d_min,
@@ -234,8 +450,15 @@ MTS_BackgroundHelper::addLines(cairo_t *cr, bool boundary, bool hatched,
     //orient the path for the line correctly
     orient_path(cr, curved, length, width, height);
 
-    // set path shape 
-    if(curved) { 
+    // a plain straight line needs no cairo path of its own
+    if(!curved && !dashed && !boundary && !hatched && !doubleline) {
+        add_straight_line(cr, 0, 0, length, 0, line_width);
+        cairo_identity_matrix(cr);
+        return;
+    }
+
+    // set path shape
+    if(curved) {
         // draw a wiggly line
         generate_curve(cr, length, height, c_min, c_max, d_min, d_max, river);
     } else { // draw a straight line
@@ -264,6 +487,7 @@ MTS_BackgroundHelper::addLines(cairo_t *cr, bool boundary, bool hatched,
         cairo_new_path(cr);
         cairo_translate(cr, x_dis, y_dis);
         cairo_append_path(cr, path_tmp);
+        cairo_path_destroy(path_tmp);
     }
 
     //stroke
@@ -523,13 +747,32 @@ MTS_BackgroundHelper::addTexture(cairo_t *cr, bool curved, double brightness,
 }
 
 
+void
+MTS_BackgroundHelper::bias_profile(vector<float> &profile,
+        vector<double> &stops) {
+
+    int num_stops = stops.size();
+    profile.resize((num_stops - 1) * BIAS_PROFILE_STEPS + 1);
+
+    // linearly interpolate between evenly spaced color stops
+    for (int i = 0; i < num_stops - 1; i++) {
+        for (int j = 0; j < BIAS_PROFILE_STEPS; j++) {
+            double frac = (double)j / BIAS_PROFILE_STEPS;
+            profile[i*BIAS_PROFILE_STEPS + j] =
+                stops[i]*(1-frac) + stops[i+1]*frac;
+        }
+    }
+    profile.back() = stops.back();
+}
+
+
 void
 MTS_BackgroundHelper::addBgBias(cairo_t *cr, int width, int height, int color){
-    //cout << "start adding bias" << endl;
-    cairo_pattern_t *pattern_vertical = cairo_pattern_create_linear(helper->rng()%width, 0,
-            helper->rng()%width, height);
-    cairo_pattern_t *pattern_horizontal = cairo_pattern_create_linear(0, helper->rng()%height,
-            width, helper->rng()%height);
+    // end points of the vertical and horizontal gradient axes
+    int vert_x0 = helper->rng()%width;
+    int vert_x1 = helper->rng()%width;
+    int horiz_y0 = helper->rng()%height;
+    int horiz_y1 = helper->rng()%height;
 
     // set the number of points
     int points_min = config->getParamInt("bias_vert_num_min");
@@ -543,9 +786,6 @@ MTS_BackgroundHelper::addBgBias(cairo_t *cr, int width, int height, int color){
                 (width/height)*points_max); 
     }
 
-    double offset_vertical = 1.0 / (num_points_vertical - 1);
-    double offset_horizontal = 1.0 / (num_points_horizontal - 1);
-
     // get and set bias std variables
     double std_scale = config->getParamDouble("bias_std_scale");
     double std_shift = config->getParamDouble("bias_std_shift");
@@ -562,17 +802,14 @@ MTS_BackgroundHelper::addBgBias(cairo_t *cr, int width, int height, int color){
     bias_gen.distribution().reset();
 
     int color_stop_val;
-    double dcolor;
+    vector<double> stops_vertical, stops_horizontal;
     // add color stops for each point along the vertical line
     for (int i = 0; i < num_points_vertical; i++){
         color_stop_val = color + (int)round(bias_gen());
         // bound the number between 0 and 255
         color_stop_val = min(color_stop_val, 255);
         color_stop_val = max(color_stop_val, 0);
-        dcolor = color_stop_val / 255.0;
-
-        cairo_pattern_add_color_stop_rgb(pattern_vertical, i*offset_vertical,
-                dcolor,dcolor,dcolor);
+        stops_vertical.push_back(color_stop_val);
     }
     // add color stops for each point along the horizontal line
     for (int i = 0; i < num_points_horizontal; i++){
@@ -580,21 +817,66 @@ MTS_BackgroundHelper::addBgBias(cairo_t *cr, int width, int height, int color){
         // bound the number between 0 and 255
         color_stop_val = min(color_stop_val, 255);
         color_stop_val = max(color_stop_val, 0);
-        dcolor = color_stop_val / 255.0;
-
-        cairo_pattern_add_color_stop_rgb(pattern_horizontal,i*offset_horizontal,
-                dcolor,dcolor,dcolor);
+        stops_horizontal.push_back(color_stop_val);
     }
 
+    // sample both 1D gradient profiles densely once, instead of letting
+    // cairo evaluate the color stops for every pixel
+    vector<float> profile_vertical, profile_horizontal;
+    bias_profile(profile_vertical, stops_vertical);
+    bias_profile(profile_horizontal, stops_horizontal);
+    int last_vertical = profile_vertical.size() - 1;
+    int last_horizontal = profile_horizontal.size() - 1;
+
+    // the gradient parameter of each pixel is its projection onto the axis,
+    // which is linear in x and y: t = t_x*x + t_y*y + t_0 (in profile steps)
+    double vdx = vert_x1 - vert_x0, vdy = height;
+    double vlen2 = vdx*vdx + vdy*vdy;
+    double vt_x = vdx / vlen2 * last_vertical;
+    double vt_y = vdy / vlen2 * last_vertical;
+    double vt_0 = (0.5 - vert_x0) * vt_x + 0.5 * vt_y;
+
+    double hdx = width, hdy = horiz_y1 - horiz_y0;
+    double hlen2 = hdx*hdx + hdy*hdy;
+    double ht_x = hdx / hlen2 * last_horizontal;
+    double ht_y = hdy / hlen2 * last_horizontal;
+    double ht_0 = 0.5 * ht_x + (0.5 - horiz_y0) * ht_y;
+
+    // painting horizontal then vertical with alpha a over the background b
+    // gives b*(1-a)^2 + h*a*(1-a) + v*a, so both are blended in one pass
     double alpha = config->getParamDouble("bias_alpha");
-    cairo_set_source(cr, pattern_horizontal);
-    cairo_paint_with_alpha(cr,alpha);
-    cairo_set_source(cr, pattern_vertical);
-    cairo_paint_with_alpha(cr,alpha);
-
-    cairo_pattern_destroy(pattern_vertical);
-    cairo_pattern_destroy(pattern_horizontal);
-    //cout << "finished bias" << endl;
+    float keep = (1-alpha) * (1-alpha);
+    float h_weight = alpha * (1-alpha);
+    float v_weight = alpha;
+
+    cairo_surface_t *surface = cairo_get_target(cr);
+    cairo_surface_flush(surface);
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    vector<float> bias(width);
+
+    for (int row = 0; row < height; row++) {
+        double vt = vt_0 + row*vt_y;
+        double ht = ht_0 + row*ht_y;
+
+        // bias added to every channel of this row (gradients pad at ends)
+        for (int col = 0; col < width; col++) {
+            int vi = min(max((int)(vt + col*vt_x + 0.5), 0), last_vertical);
+            int hi = min(max((int)(ht + col*ht_x + 0.5), 0), last_horizontal);
+            bias[col] = profile_horizontal[hi]*h_weight +
+                profile_vertical[vi]*v_weight + 0.5f;
+        }
+
+        // blend into the B, G and R bytes of the opaque background
+        unsigned char *pixel = data + row*stride;
+        for (int col = 0; col < width; col++) {
+            pixel[4*col] = (unsigned char)(pixel[4*col]*keep + bias[col]);
+            pixel[4*col+1] = (unsigned char)(pixel[4*col+1]*keep + bias[col]);
+            pixel[4*col+2] = (unsigned char)(pixel[4*col+2]*keep + bias[col]);
+        }
+    }
+
+    cairo_surface_mark_dirty(surface);
 }
 
 
@@ -711,15 +993,15 @@ MTS_BackgroundHelper::addBgPattern (cairo_t *cr, int width, int height,
         if (curved) {
             // draw curved path 
             helper->points_to_path(cr, points, c_min, c_max, d_min, d_max);
+
+            // stroke the path
+            cairo_stroke(cr);
         } else {
-            // draw line path
-            cairo_move_to(cr,points[0].first,points[0].second);
-            cairo_line_to(cr,points[points.size()-1].first,
-                    points[points.size()-1].second);
+            // draw straight line
+            add_straight_line(cr, points[0].first, points[0].second,
+                    points[points.size()-1].first,
+                    points[points.size()-1].second, line_width);
         }
-
-        // stroke the path
-        cairo_stroke(cr);
     }
 
     // draw grid
@@ -734,15 +1016,15 @@ MTS_BackgroundHelper::addBgPattern (cairo_t *cr, int width, int height,
             if (curved) {
                 // draw curved path shape
                 helper->points_to_path(cr, points, c_min, c_max, d_min, d_max); 
+
+                // stroke the path
+                cairo_stroke(cr);
             } else {
-                // draw line path 
-                cairo_move_to(cr,points[0].first,points[0].second);
-                cairo_line_to(cr,points[points.size() - 1].first,
-                        points[points.size() - 1].second);
+                // draw straight line
+                add_straight_line(cr, points[0].first, points[0].second,
+                        points[points.size() - 1].first,
+                        points[points.size() - 1].second, line_width);
             }
-
-            // stroke the path
-            cairo_stroke(cr);
         }
     }
 
@@ -871,78 +1153,127 @@ MTS_BackgroundHelper::cityPoint(cairo_t *cr, int width, int height, bool hollow)
 }
 
 
-void
-MTS_BackgroundHelper::generateBgFeatures(vector<BGFeature> &bg_features){
-
-    // get probabilities of all bg features
-    int maxnum=config->getParamDouble("max_num_features");
-    double probs[12]={
-        config->getParamDouble("diff_prob"),
-        config->getParamDouble("distract_prob"),
-        config->getParamDouble("boundary_prob"),
-        config->getParamDouble("blob_prob"),
-        config->getParamDouble("straight_prob"),
-        config->getParamDouble("grid_prob"),
-        config->getParamDouble("point_prob"),
-        config->getParamDouble("para_prob"),
-        config->getParamDouble("vpara_prob"),
-        config->getParamDouble("texture_prob"),
-        config->getParamDouble("railroad_prob"),
-        config->getParamDouble("river_prob"),
-    };
-
-    // init the vector of all possible features to sample from
-    vector<BGFeature> all_features={Colordiff, Distracttext, Boundary,
-        Colorblob, Straight, Grid, Citypoint, Parallel, Vparallel, Texture,
-        Railroad, Riverline};
-    int j, cur_index, count = 0;
+BGFeatureMask
+MTS_BackgroundHelper::generateBgFeatures(){
+
+    // the features still left to sample from
+    BGFeature remaining[NUM_BG_FEATURES];
+    int num_remaining = candidate_features.size();
+    std::copy(candidate_features.begin(), candidate_features.end(), remaining);
+
+    BGFeatureMask bg_features = 0;
+    int j, count = 0;
     bool flag;
     BGFeature cur;
 
     // iterate through all bg features, applying it based on probability
     // until maxnum of features is reached, or there are no features left
-    while (count < maxnum && all_features.size() > 0){
+    while (count < max_num_features && num_remaining > 0){
         flag = true;
 
-        while (flag && all_features.size() > 0) { 
-            j = helper->rng() % all_features.size();
-            cur = all_features[j];
-            all_features.erase(all_features.begin()+j);
+        while (flag && num_remaining > 0) { 
+            j = helper->rng() % num_remaining;
+            cur = remaining[j];
+            std::copy(remaining+j+1, remaining+num_remaining, remaining+j);
+            num_remaining--;
 
-            if (cur == Vparallel &&
-                    find(bg_features.begin(), bg_features.end(), Parallel) !=
-                    bg_features.end()) {
+            if (cur == Vparallel && (bg_features & featureBit(Parallel))) {
                 continue;
             }
-            if (cur == Parallel &&
-                    find(bg_features.begin(), bg_features.end(), Vparallel)
-                    != bg_features.end()) {
+            if (cur == Parallel && (bg_features & featureBit(Vparallel))) {
                 continue;
             }
 
             flag=false;
 
-            cur_index=static_cast<int>(cur);
-            // if probability of bg feature at cur_index succedes, add it to 
-            // the features to be applied vector 
-            if(helper->rndProbUnder(probs[cur_index])){
-                bg_features.push_back(cur);
+            // if probability of bg feature cur succedes, add it to 
+            // the features to be applied
+            if(helper->rndProbUnder(feature_probs[cur])){
+                bg_features |= featureBit(cur);
                 count++;
             }
         }
     }
+    return bg_features;
+}
+
+
+void
+MTS_BackgroundHelper::update_cost(CostEstimate &est,
+        steady_clock::duration elapsed, double pixels) {
+
+    double sample = duration<double, std::micro>(elapsed).count() / pixels;
+
+    // the first timings are averaged (one may include cold caches and
+    // lazy initialization), later ones are smoothed
+    est.timings++;
+    est.drops = 0;
+    if (est.timings <= COST_WARMUP_TIMINGS) {
+        est.cost += (sample - est.cost) / est.timings;
+    } else {
+        est.cost += COST_SMOOTHING * (sample - est.cost);
+    }
+}
+
+
+BGFeatureMask
+MTS_BackgroundHelper::fitTimeBudget(BGFeatureMask features, int width,
+        int height) {
+
+    if (bg_time_budget_us <= 0) return features;
+
+    double pixels = (double) width * height;
+    double predicted = base_cost.cost * pixels;
+    BGFeatureMask droppable = 0;
+    for (int i = 0; i < NUM_BG_FEATURES; i++) {
+        if (features & featureBit(static_cast<BGFeature>(i))) {
+            predicted += feature_costs[i].cost * pixels;
+
+            // keep features until their estimate is trusted, and now and
+            // then one that keeps being dropped, so it gets timed again
+            if (feature_costs[i].timings >= COST_WARMUP_TIMINGS &&
+                    feature_costs[i].drops < COST_PROBE_INTERVAL) {
+                droppable |= featureBit(static_cast<BGFeature>(i));
+            }
+        }
+    }
+
+    // drop the most expensive feature until the estimate fits
+    BGFeatureMask kept = features;
+    while (predicted > bg_time_budget_us) {
+        int worst = -1;
+        for (int i = 0; i < NUM_BG_FEATURES; i++) {
+            if ((kept & droppable & featureBit(static_cast<BGFeature>(i)))
+                    && (worst < 0 ||
+                        feature_costs[i].cost > feature_costs[worst].cost)) {
+                worst = i;
+            }
+        }
+        if (worst < 0) break;
+
+        kept &= ~featureBit(static_cast<BGFeature>(worst));
+        predicted -= feature_costs[worst].cost * pixels;
+        feature_costs[worst].drops++;
+    }
+    return kept;
 }
 
 
 void 
 MTS_BackgroundHelper::generateBgSample(cairo_surface_t *&bg_surface, 
-        vector<BGFeature> &features, int height, int width, int bg_color, int contrast){
+        BGFeatureMask &features, int height, int width, int bg_color, int contrast){
 
     //cout << "bg color " << bg_color << endl;
     //cout << "constrast " << contrast << endl;
 
     double c_min, c_max, d_min, d_max, curve_prob;
     int num_lines;
+
+    // leave out the most expensive features if they would not fit the budget
+    features = fitTimeBudget(features, width, height);
+    double pixels = (double) width * height;
+    steady_clock::time_point start = steady_clock::now();
+
     //cout << "generating bg sample" << endl;
     // initialize the cairo image variables for background
     cairo_surface_t *surface;
@@ -953,19 +1284,27 @@ MTS_BackgroundHelper::generateBgSample(cairo_surface_t *&bg_surface,
     // paint initial background brightness
     cairo_set_source_rgb(cr, bg_color/255.0,bg_color/255.0,bg_color/255.0);
     cairo_paint (cr);
+    steady_clock::duration base_time = steady_clock::now() - start;
 
-    if (find(features.begin(), features.end(), Colordiff)!= features.end()) {
+    if (features & featureBit(Colordiff)) {
+        start = steady_clock::now();
         double color_dis = config->getParamDouble("diff_color_distance");
         double color_min = (bg_color-contrast+color_dis)/255.0;
         double color_max = bg_color/255.0;
         if (color_min > color_max) color_min=color_max;
         colorDiff(cr, width, height, color_min, color_max);
+        update_cost(feature_costs[Colordiff], steady_clock::now() - start,
+                pixels);
     }
 
     //add background bias field
+    start = steady_clock::now();
     addBgBias(cr, width, height, bg_color);
+    base_time += steady_clock::now() - start;
+    update_cost(base_cost, base_time, pixels);
 
-    if (find(features.begin(), features.end(), Colorblob)!= features.end()) {
+    if (features & featureBit(Colorblob)) {
+        start = steady_clock::now();
         int num_min= config->getParamInt("blob_num_min");
         int num_max= config->getParamInt("blob_num_max");
         double size_min = config->getParamDouble("blob_size_min");
@@ -973,6 +1312,8 @@ MTS_BackgroundHelper::generateBgSample(cairo_surface_t *&bg_surface,
         double dim_rate = config->getParamDouble("blob_diminish_rate");
         helper->addSpots(surface,num_min,num_max,size_min,size_max,dim_rate,
                 false,bg_color-contrast, bg_color);
+        update_cost(feature_costs[Colorblob], steady_clock::now() - start,
+                pixels);
     }
 
     // set background source brightness
@@ -986,7 +1327,8 @@ MTS_BackgroundHelper::generateBgSample(cairo_surface_t *&bg_surface,
 
     // GENERATE BACKGROUND FEATURES:
     // add texture swaths by probability
-    if (find(features.begin(), features.end(), Texture)!= features.end()) {
+    if (features & featureBit(Texture)) {
+        start = steady_clock::now();
         c_min = config->getParamDouble("texture_curve_c_min");
         c_max = config->getParamDouble("texture_curve_c_max");
         d_min = config->getParamDouble("texture_curve_d_min");
@@ -1001,31 +1343,43 @@ MTS_BackgroundHelper::generateBgSample(cairo_surface_t *&bg_surface,
             addTexture(cr, (bool) helper->rng() % 2, color, width, height,
                     c_min, c_max, d_min, d_max); 
         }
+        update_cost(feature_costs[Texture], steady_clock::now() - start,
+                pixels);
     }
 
     // add evenly spaced parallel lines by probability
-    if (find(features.begin(), features.end(), Parallel)!= features.end()) {
+    if (features & featureBit(Parallel)) {
+        start = steady_clock::now();
         curve_prob = config->getParamDouble("para_curve_prob");
         addBgPattern(cr, width, height, true, false,
                 helper->rndProbUnder(curve_prob));
+        update_cost(feature_costs[Parallel], steady_clock::now() - start,
+                pixels);
     }
 
     // add varied parallel lines by probability
-    if (find(features.begin(), features.end(), Vparallel)!= features.end()) {
+    if (features & featureBit(Vparallel)) {
+        start = steady_clock::now();
         curve_prob = config->getParamDouble("vpara_curve_prob");
         addBgPattern(cr, width, height, false, false,
                 helper->rndProbUnder(curve_prob));
+        update_cost(feature_costs[Vparallel], steady_clock::now() - start,
+                pixels);
     }
 
     // add grid lines by probability
-    if (find(features.begin(), features.end(), Grid)!= features.end()) {
+    if (features & featureBit(Grid)) {
+        start = steady_clock::now();
         curve_prob = config->getParamDouble("grid_curve_prob");
         addBgPattern(cr, width, height, true, true,
                 helper->rndProbUnder(curve_prob));
+        update_cost(feature_costs[Grid], steady_clock::now() - start,
+                pixels);
     }
 
     // add railroads by probability
-    if (find(features.begin(), features.end(), Railroad)!= features.end()) {
+    if (features & featureBit(Railroad)) {
+        start = steady_clock::now();
         int railroad_min = config->getParamInt("railroad_num_lines_min");
         int railroad_max = config->getParamInt("railroad_num_lines_max");
         c_min = config->getParamDouble("railroad_curve_c_min");
@@ -1039,10 +1393,13 @@ MTS_BackgroundHelper::generateBgSample(cairo_surface_t *&bg_surface,
             addLines(cr, false, true, false, true, false, false, width, height,
                     c_min, c_max, d_min, d_max);
         }
+        update_cost(feature_costs[Railroad], steady_clock::now() - start,
+                pixels);
     }
 
     // add boundary lines by probability
-    if (find(features.begin(), features.end(), Boundary)!= features.end()) {
+    if (features & featureBit(Boundary)) {
+        start = steady_clock::now();
         int boundary_min = config->getParamInt("boundary_num_lines_min");
         int boundary_max = config->getParamInt("boundary_num_lines_max");
 
@@ -1059,10 +1416,13 @@ MTS_BackgroundHelper::generateBgSample(cairo_surface_t *&bg_surface,
                     true, false, false, width, height, c_min, c_max, d_min,
                     d_max, color);
         }
+        update_cost(feature_costs[Boundary], steady_clock::now() - start,
+                pixels);
     }
 
     // add straight lines by probability
-    if (find(features.begin(), features.end(), Straight)!= features.end()) {
+    if (features & featureBit(Straight)) {
+        start = steady_clock::now();
         int straight_min = config->getParamInt("straight_num_lines_min");
         int straight_max = config->getParamInt("straight_num_lines_max");
 
@@ -1074,10 +1434,13 @@ MTS_BackgroundHelper::generateBgSample(cairo_surface_t *&bg_surface,
             addLines(cr, false, false, helper->rndProbUnder(dash_probability),
                     false, false, false, width, height);
         }
+        update_cost(feature_costs[Straight], steady_clock::now() - start,
+                pixels);
     }
 
     // add rivers by probability
-    if (find(features.begin(), features.end(), Riverline)!= features.end()) {
+    if (features & featureBit(Riverline)) {
+        start = steady_clock::now();
         int river_min = config->getParamInt("river_num_lines_min");
         int river_max = config->getParamInt("river_num_lines_max");
 
@@ -1094,10 +1457,13 @@ MTS_BackgroundHelper::generateBgSample(cairo_surface_t *&bg_surface,
             addLines(cr, false, false, false, true, helper->rndProbUnder(double_prob), true, 
                     width, height, c_min, c_max, d_min, d_max);
         }
+        update_cost(feature_costs[Riverline], steady_clock::now() - start,
+                pixels);
     }
 
     // add city point by probability
-    if (find(features.begin(), features.end(), Citypoint)!= features.end()) {
+    if (features & featureBit(Citypoint)) {
+        start = steady_clock::now();
         double hollow = config->getParamDouble("point_hollow_prob");
         int num_min = config->getParamInt("point_num_min");
         int num_max = config->getParamInt("point_num_max");
@@ -1105,6 +1471,8 @@ MTS_BackgroundHelper::generateBgSample(cairo_surface_t *&bg_surface,
         for (int i = 0; i < point_num; i++) {
             cityPoint(cr, width, height, helper->rndProbUnder(hollow));
         }
+        update_cost(feature_costs[Citypoint], steady_clock::now() - start,
+                pixels);
     }
 
     // save generated cairo surface as the background surface
@@ -143,17 +143,32 @@ MTSImplementation::MTSImplementation(string config_file)
 {
     //initialize rng in BaseHelper
     uint64 seed = (uint64)config->getParamDouble("seed");
-    helper->setSeed(seed != 0 ? seed : time(NULL));
+    setSeed(seed != 0 ? seed : time(NULL));
+}
+
+void MTSImplementation::setSeed(uint64 seed) {
+    helper->setSeed(seed);
+
+    // the distribution generators hold their own copies of the engine
+    noise_gen.engine().seed((uint32_t)seed);
+    th.setSeed(seed);
+    bh.setSeed(seed);
 }
 
 MTSImplementation::~MTSImplementation() {
 }
 
 void MTSImplementation::generateSample(string &caption, Mat &sample, int &actual_height){
+    MTSSampleInfo info;
+    generateSample(caption, sample, actual_height, info);
+}
+
+void MTSImplementation::generateSample(string &caption, Mat &sample,
+        int &actual_height, MTSSampleInfo &info){
 
     //cout << "start generate sample" << endl;
-    vector<BGFeature> bg_features;
-    bh.generateBgFeatures(bg_features);
+    BGFeatureMask bg_features = bh.generateBgFeatures();
+    BGFeatureMask requested_features = bg_features;
 
     // set bg and text color (brightness) based on user configured parameters
     int bgcolor_min = config->getParamInt("bg_color_min");
@@ -186,8 +201,7 @@ void MTSImplementation::generateSample(string &caption, Mat &sample, int &actual
 
     //cout << "text" << endl;
     // use TextHelper instance to generate synthetic text
-    if (std::find(bg_features.begin(), bg_features.end(), Distracttext)!=
-            bg_features.end()) {
+    if (bg_features & featureBit(Distracttext)) {
         // generate distractor text
         th.generateTextSample(caption,text_surface,height,
                 width,text_color,true);
@@ -202,6 +216,8 @@ void MTSImplementation::generateSample(string &caption, Mat &sample, int &actual
     cairo_surface_t *bg_surface;
     bh.generateBgSample(bg_surface, bg_features, height, width,
             bg_brightness, contrast);
+    info.bg_features = bg_features;
+    info.dropped_bg_features = requested_features & ~bg_features;
     cairo_t *cr = cairo_create(bg_surface);
     cairo_set_source_surface(cr, text_surface, 0, 0);
 
@@ -88,13 +88,40 @@ MTS_TextHelper::MTS_TextHelper(shared_ptr<MTS_BaseHelper> h, shared_ptr<MTSConfi
         cerr << "config file need a captions parameter in it!" << endl;
         exit(1);
     }
+
+    // the distractor bank size is optional
+    distract_bank_size = 8;
+    if (config->findParam("distract_bank_size")) {
+        distract_bank_size = config->getParamInt("distract_bank_size");
+    }
+    if (distract_bank_size < 1) distract_bank_size = 1;
+
+    // so is its memory budget, over all fonts
+    double bank_mb = 16;
+    if (config->findParam("distract_bank_mb")) {
+        bank_mb = config->getParamDouble("distract_bank_mb");
+    }
+    distract_bank_budget = (size_t)(max(bank_mb, 0.0) * 1024 * 1024);
+    distract_bank_bytes = 0;
 }
 
 MTS_TextHelper::~MTS_TextHelper(){
+    // free the distractor sprites
+    while (!distract_lru.empty()) {
+        evictDistractFont();
+    }
 }
 
 // SEE mts_texthelper.hpp FOR ALL DOCUMENTATION
 
+void
+MTS_TextHelper::setSeed(uint64 seed) {
+    // offset the seeds so the generators don't share one stream
+    spacing_gen.engine().seed((uint32_t)seed);
+    stretch_gen.engine().seed((uint32_t)(seed + 1));
+    digit_len_gen.engine().seed((uint32_t)(seed + 2));
+}
+
 void 
 MTS_TextHelper::updateFontNameList(vector<string>& font_list) {
     // clear existing fonts for a fresh load of available fonts
@@ -427,13 +454,14 @@ MTS_TextHelper::create_curved_text(cairo_t *cr, PangoLayout *layout,
     // Decrease tolerance, since the text going to be magnified 
     cairo_set_tolerance(cr, 0.01);
 
-    path = cairo_copy_path(cr);
+    cairo_path_t *curve = cairo_copy_path(cr);
     cairo_new_path(cr);
 
     // move path to right place
     cairo_translate(cr,-4*height,0);
-    cairo_append_path(cr,path);
+    cairo_append_path(cr,curve);
     cairo_translate(cr,4*height,0);
+    cairo_path_destroy(curve);
     path = cairo_copy_path_flat(cr);
     cairo_new_path(cr);
 
@@ -489,6 +517,7 @@ MTS_TextHelper::create_curved_text(cairo_t *cr, PangoLayout *layout,
         cairo_restore(cr);
         if (path_so_far != NULL) {
             cairo_append_path(cr, path_so_far);
+            cairo_path_destroy(path_so_far);
         }
         path_so_far = cairo_copy_path(cr);
         cairo_path_destroy(tmp_path);
@@ -714,6 +743,7 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
         cairo_append_path(cr, path_n);
         cairo_translate(cr, x1, y1);
         // copy the path out
+        cairo_path_destroy(path_n);
         path_n=cairo_copy_path(cr);
 
         if (path != NULL) {
@@ -722,6 +752,7 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
             cairo_append_path(cr, path);
             cairo_translate(cr, x1, y1);
             // copy the path out
+            cairo_path_destroy(path);
             path=cairo_copy_path(cr);
 
             cairo_new_path(cr);
@@ -751,6 +782,7 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
         if (path != NULL) {
             cairo_append_path(cr,path);
             cairo_restore(cr);
+            cairo_path_destroy(path);
             path=cairo_copy_path(cr);
             cairo_new_path(cr);
             cairo_scale(cr,height_ratio,height_ratio);
@@ -802,6 +834,7 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
         cairo_append_path(cr_n,path);
         double cx1,cy1,cx2,cy2;
         cairo_path_extents(cr_n, &cx1, &cy1, &cx2, &cy2);
+        cairo_path_destroy(path);
         path = cairo_copy_path(cr_n);
         cairo_new_path(cr_n);
 
@@ -817,6 +850,8 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
         cairo_set_line_width(cr_n, linewidth);
         cairo_stroke(cr_n);
         cairo_restore(cr_n);
+    }
+    if (path != NULL) {
         cairo_path_destroy(path);
     }
 
@@ -842,10 +877,7 @@ MTS_TextHelper::generateTextPatch(cairo_surface_t *&text_surface,
 
         // draw the random number of distracting strings
         for (int i = 0; i < dis_num; i++) {
-            char distract_font[50];
-            // set the font and draw the text
-            generateFont(distract_font,(int)(shrink*height));
-            distractText(cr_n, patch_width, height, distract_font);
+            distractText(cr_n, patch_width, height, (int)(shrink*height));
         }
     }
 
@@ -917,42 +949,131 @@ MTS_TextHelper::randomDigit() {
 }
 
 void
-MTS_TextHelper::distractText (cairo_t *cr, int width, int height, char *font) {
-
-    // generate text
-    int len_min = config->getParamInt("distract_len_min");
-    int len_max = config->getParamInt("distract_len_max");
-    int len = helper->rndBetween(len_min,len_max); 
-    char text[len+1];
+MTS_TextHelper::renderDistractSprite(DistractSprite &sprite, const char *font){
 
     // generate a random string of characters
+    int len = config->getParamInt("distract_len_max") * DISTRACT_SPRITE_REPEAT;
+    if (len < 1) len = 1;
+    string text;
     for (int i = 0; i < len; i++) {
-        text[i] = randomChar();
+        text += randomChar();
     }
-    text[len] = '\0'; //null terminate the cstring
 
-    // use pango to turn cstring into vector text
-    PangoLayout *layout;
-    PangoFontDescription *desc;
-    layout = pango_cairo_create_layout(cr);
-
-    desc = pango_font_description_from_string(font);
+    // use pango to turn the string into vector text
+    cairo_surface_t *scratch = cairo_image_surface_create(CAIRO_FORMAT_A8,1,1);
+    cairo_t *cr = cairo_create(scratch);
+    PangoLayout *layout = pango_cairo_create_layout(cr);
+    PangoFontDescription *desc = pango_font_description_from_string(font);
     pango_layout_set_font_description(layout, desc);
-    pango_layout_set_text(layout, text, -1);
+    pango_layout_set_text(layout, text.c_str(), -1);
 
-    // find text bounding rectangle
-    PangoRectangle text_rect;
     PangoRectangle logical_rect;
-    pango_layout_get_extents(layout, &text_rect, &logical_rect);
+    pango_layout_get_pixel_extents(layout, NULL, &logical_rect);
+    int sprite_width = max(1, logical_rect.width);
+    sprite.height = max(1, logical_rect.height);
+
+    // record where each character starts (the text is plain ascii, so byte
+    // and character indices are the same)
+    sprite.char_x.clear();
+    PangoRectangle pos;
+    for (int i = 0; i < len; i++) {
+        pango_layout_index_to_pos(layout, i, &pos);
+        sprite.char_x.push_back(pos.x / PANGO_SCALE);
+    }
+    sprite.char_x.push_back(sprite_width);
+
+    // render the text into the mask
+    sprite.surface = cairo_image_surface_create(CAIRO_FORMAT_A8,
+            sprite_width, sprite.height);
+    cairo_t *cr_s = cairo_create(sprite.surface);
+    pango_cairo_update_layout(cr_s, layout);
+    pango_cairo_show_layout(cr_s, layout);
+
+    // clean up
+    cairo_destroy(cr_s);
+    g_object_unref(layout);
+    pango_font_description_free(desc);
+    cairo_destroy(cr);
+    cairo_surface_destroy(scratch);
+}
+
+void
+MTS_TextHelper::evictDistractFont() {
+    std::map<string, DistractFont>::iterator it =
+        distract_bank.find(distract_lru.back());
+    vector<DistractSprite> &sprites = it->second.sprites;
+    for (int i = 0; i < sprites.size(); i++) {
+        distract_bank_bytes -= cairo_image_surface_get_stride(
+                sprites[i].surface) * sprites[i].height;
+        cairo_surface_destroy(sprites[i].surface);
+    }
+    distract_bank.erase(it);
+    distract_lru.pop_back();
+}
+
+void
+MTS_TextHelper::distractText (cairo_t *cr, int width, int height, int fontsize) {
+
+    // snap the font size to a bucket so that sprites can be shared, the
+    // difference is made up by scaling
+    int bucket = (int)round(DISTRACT_SIZE_BUCKETS * log2(max(fontsize,1)));
+    int bucket_size = (int)round(pow(2.0, bucket/(double)DISTRACT_SIZE_BUCKETS));
+    double scale = fontsize / (double)bucket_size;
+
+    char font[50];
+    generateFont(font, bucket_size);
+
+    // move the font to the front of the recently used list
+    std::map<string, DistractFont>::iterator it = distract_bank.find(font);
+    if (it == distract_bank.end()) {
+        it = distract_bank.insert(std::make_pair(string(font),
+                    DistractFont())).first;
+        distract_lru.push_front(it->first);
+    } else {
+        distract_lru.splice(distract_lru.begin(), distract_lru,
+                it->second.lru);
+    }
+    it->second.lru = distract_lru.begin();
+
+    // render a new sprite until the bank for this font is full, after that
+    // reuse a random one
+    vector<DistractSprite> &sprites = it->second.sprites;
+    DistractSprite *sprite;
+    if (sprites.size() < distract_bank_size) {
+        sprites.push_back(DistractSprite());
+        sprite = &sprites.back();
+        renderDistractSprite(*sprite, font);
+        distract_bank_bytes += cairo_image_surface_get_stride(sprite->surface)
+            * sprite->height;
+
+        // make room by dropping the fonts used least recently (never this
+        // one, so the bank may go over budget by a single font)
+        while (distract_bank_bytes > distract_bank_budget &&
+                distract_lru.size() > 1) {
+            evictDistractFont();
+        }
+    } else {
+        sprite = &sprites[helper->rng() % sprites.size()];
+    }
 
-    // get the text dimensions from its bounding rectangle
-    int text_width = text_rect.width/PANGO_SCALE;
-    int text_height = text_rect.height/PANGO_SCALE;
+    // choose a random run of characters from the sprite
+    int len_min = config->getParamInt("distract_len_min");
+    int len_max = config->getParamInt("distract_len_max");
+    int len = helper->rndBetween(len_min,len_max); 
+    int num_chars = sprite->char_x.size() - 1;
+    if (len > num_chars) len = num_chars;
+    if (len < 1) return;
+    int first = helper->rng() % (num_chars - len + 1);
+
+    int crop_x = sprite->char_x[first];
+    int text_width = sprite->char_x[first + len] - crop_x;
+    int text_height = sprite->height;
 
     // translate to arbitrary point on the canvas
     int x = helper->rng()%width;
     int y = helper->rng()%height;
     cairo_translate (cr, (double)x, (double)y);
+    cairo_scale(cr, scale, scale);
 
     // randomly choose and set rotation angle
     int deg = helper->rng() % 360;
@@ -962,11 +1083,13 @@ MTS_TextHelper::distractText (cairo_t *cr, int width, int height, char *font) {
     cairo_rotate(cr, rad);
     cairo_translate (cr, -text_width/2.0, -text_height/2.0);
 
-    // put text on cairo context
-    pango_cairo_show_layout (cr, layout);
+    // paint the cropped characters with the current source color
+    cairo_save(cr);
+    cairo_rectangle(cr, 0, 0, text_width, text_height);
+    cairo_clip(cr);
+    cairo_mask_surface(cr, sprite->surface, -crop_x, 0);
+    cairo_restore(cr);
 
     // clean up 
     cairo_identity_matrix(cr);
-    g_object_unref(layout);
-    pango_font_description_free(desc);
 }
@@ -16,13 +16,15 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 '''
 
+from __future__ import print_function
+
 import numpy as np
 import ctypes as c
 import cv2
 import time
 import os
 
-def get_mts_interface_lib():
+def get_mts_interface_lib(release_gil=True):
     """ Prep and return lib for mts interfacing """
 
     # Allow for transparent use when importing elsewhere in filesys
@@ -30,7 +32,12 @@ def get_mts_interface_lib():
     abs_path = os.path.dirname(os.path.abspath(__file__))
     lib_path_complete = abs_path + os.path.sep + libname
     
-    lib = c.cdll.LoadLibrary(lib_path_complete)
+    # CDLL releases the GIL around every call, so other Python threads run
+    # while a call waits for a sample. PyDLL holds on to it, saving the
+    # release and reacquire on calls that return right away (e.g. with a
+    # well stocked prefetch queue)
+    loader = c.cdll if release_gil else c.pydll
+    lib = loader.LoadLibrary(lib_path_complete)
 
     # get_sample takes no args, returns void*
     lib.get_sample.argtypes = [c.c_void_p]
@@ -39,11 +46,27 @@ def get_mts_interface_lib():
     # free_sample takes void*, returns nothing
     lib.free_sample.argtypes = [c.c_void_p]
     lib.free_sample.restype = None
+
+    # acquire_sample takes void* to the MTS_Buff, returns void*
+    # (sample stays in shared memory until released)
+    lib.acquire_sample.argtypes = [c.c_void_p]
+    lib.acquire_sample.restype = c.c_void_p
+
+    # release_sample takes void* to the MTS_Buff and void*, returns nothing
+    lib.release_sample.argtypes = [c.c_void_p, c.c_void_p]
+    lib.release_sample.restype = None
     
     # get_caption takes void*, returns char* (null terminated)
     lib.get_caption.argtypes = [c.c_void_p]
     lib.get_caption.restype = c.c_char_p 
 
+    # get_bg_features/get_dropped_bg_features take void*, return the bit
+    # mask of MTSSampleInfo (map_text_synthesizer.hpp) as an unsigned int
+    lib.get_bg_features.argtypes = [c.c_void_p]
+    lib.get_bg_features.restype = c.c_uint
+    lib.get_dropped_bg_features.argtypes = [c.c_void_p]
+    lib.get_dropped_bg_features.restype = c.c_uint
+
     # get_height takes void*, returns size_t 
     lib.get_height.argtypes = [c.c_void_p]
     lib.get_height.restype = c.c_ulonglong 
@@ -57,37 +80,77 @@ def get_mts_interface_lib():
     lib.get_img_data.argtypes = [c.c_void_p]
     lib.get_img_data.restype = c.c_void_p
 
+    # get_batch/get_batch_float take void* to the MTS_Buff, batch size,
+    # height, max width, image buffer, int* widths, char** labels,
+    # return number of skipped samples
+    lib.get_batch.argtypes = [c.c_void_p, c.c_int, c.c_int, c.c_int,
+                              c.c_void_p, c.c_void_p, c.c_void_p]
+    lib.get_batch.restype = c.c_int
+    lib.get_batch_float.argtypes = [c.c_void_p, c.c_int, c.c_int, c.c_int,
+                                    c.c_void_p, c.c_void_p, c.c_void_p]
+    lib.get_batch_float.restype = c.c_int
+
+    # free_labels takes char** labels and their count, returns nothing
+    lib.free_labels.argtypes = [c.c_void_p, c.c_int]
+    lib.free_labels.restype = None
+
     # in: string: config_path
     # out: void* to the MTS_Buff object
     lib.mts_init.argtypes = [c.c_char_p, c.c_int] 
     lib.mts_init.restype = c.c_void_p
 
+    # in: string: config_path, num producers, num consumers
+    # out: void* to the MTS_Buff object (consumer 0)
+    lib.mts_init_shared.argtypes = [c.c_char_p, c.c_int, c.c_int]
+    lib.mts_init_shared.restype = c.c_void_p
+
+    # in: string: config_path, num producers, num consumers,
+    #     string: producer CPUs, string: reserved CPUs (None: any, none),
+    #     NUMA node (-1: any), pin producers (0 or 1)
+    # out: void* to the MTS_Buff object (consumer 0)
+    lib.mts_init_placed.argtypes = [c.c_char_p, c.c_int, c.c_int,
+                                    c.c_char_p, c.c_char_p, c.c_int, c.c_int]
+    lib.mts_init_placed.restype = c.c_void_p
+
+    # in: string: path from get_shared_path, consumer index
+    # out: void* to the MTS_Buff object (NULL on failure)
+    lib.mts_attach.argtypes = [c.c_char_p, c.c_int]
+    lib.mts_attach.restype = c.c_void_p
+
+    # in: void* to the MTS_Buff object, number of samples to keep ready
+    # out: void* to the prefetching MTS_Buff object that now owns it
+    lib.mts_prefetch.argtypes = [c.c_void_p, c.c_int]
+    lib.mts_prefetch.restype = c.c_void_p
+
+    # get_shared_path takes char* buffer and its length, returns length
+    lib.get_shared_path.argtypes = [c.c_char_p, c.c_int]
+    lib.get_shared_path.restype = c.c_int
+
     # in: void* to MTS_Buff, out: void
     lib.mts_cleanup.argtypes = [c.c_void_p]
     lib.mts_cleanup.restype = None
     
     return lib
 
+def to_str(label):
+    """ Labels come back from ctypes as bytes on Python 3 """
+    return label if isinstance(label, str) else label.decode('utf-8')
+
+
 def format_sample(lib, ptr):
     """ Transform raw data ptr into usable data """
-    # For c array -> numpy conversion
-    buffer_from_memory = c.pythonapi.PyBuffer_FromMemory
-    buffer_from_memory.restype = c.py_object
-
     if not ptr:
-        print "No sample produced."
+        print("No sample produced.")
         exit()
 
     # Trivial extraction for 'simple' args
     height = lib.get_height(ptr)
     raw_data = lib.get_img_data(ptr)
-    caption = lib.get_caption(ptr)
+    caption = to_str(lib.get_caption(ptr))
     width = lib.get_width(ptr)
     raw_data_ptr = c.cast(raw_data, c.POINTER(c.c_ubyte))
-    # https://stackoverflow.com/questions/4355524/getting-data-from-ctypes-array-into-numpy
-    # Above link used as reference for c array -> numpy conversion
-    buffer = buffer_from_memory(raw_data_ptr, width*height)
-    img_flat = np.frombuffer(buffer, np.uint8)
+    # View of the c array (no copy), valid until the sample is freed
+    img_flat = np.ctypeslib.as_array(raw_data_ptr, shape=(width*height,))
 
     # Convert to [height, width, 1] shape
     img_shaped = np.reshape(img_flat, (height, width, 1))
@@ -95,19 +158,126 @@ def format_sample(lib, ptr):
     return (caption, img_shaped)
 
         
-def multithreaded_data_generator(config_file, num_producers):
-    """ Generator to be used in tensorflow """
+def placed_producers(mtsi_lib, config_file_b, num_producers, num_consumers,
+                     producer_cpus=None, reserved_cpus=None, numa_node=None,
+                     pin_producers=False):
+    """ Start producers with the placement of shared_producers """
+    return mtsi_lib.mts_init_placed(
+        config_file_b, num_producers, num_consumers,
+        producer_cpus.encode('utf-8') if producer_cpus else None,
+        reserved_cpus.encode('utf-8') if reserved_cpus else None,
+        -1 if numa_node is None else numa_node, int(pin_producers))
+
+
+def prefetched(mtsi_lib, mts_buff, prefetch):
+    """ Have a background thread keep prefetch samples of mts_buff ready
+    (0: none, samples are made when asked for) """
+    if prefetch > 0:
+        return mtsi_lib.mts_prefetch(mts_buff, prefetch)
+    return mts_buff
+
+
+def multithreaded_data_generator(config_file, num_producers, prefetch=0,
+                                 release_gil=True, bg_features=False,
+                                 **placement):
+    """ Generator to be used in tensorflow (prefetch as in prefetched,
+    release_gil as in get_mts_interface_lib, bg_features as in
+    sample_generator, placement as in shared_producers) """
+    mtsi_lib = get_mts_interface_lib(release_gil)
+    config_file_b = config_file.encode('utf-8')
+    if placement and num_producers >= 1:
+        mts_buff = placed_producers(mtsi_lib, config_file_b, num_producers,
+                                    1, **placement)
+    else:
+        mts_buff = mtsi_lib.mts_init(config_file_b, num_producers)
+    mts_buff = prefetched(mtsi_lib, mts_buff, prefetch)
+    return sample_generator(mtsi_lib, mts_buff, bg_features)
+
+
+def shared_producers(config_file, num_producers, num_consumers,
+                     producer_cpus=None, reserved_cpus=None, numa_node=None,
+                     pin_producers=False):
+    """ Start producers shared by num_consumers processes (e.g. the ranks
+    of a data parallel job on one host), this one being consumer 0.
+    Returns its sample generator and the path consumers 1 ..
+    num_consumers-1 pass to attached_data_generator. Every sample goes to
+    exactly one consumer.
+    Producers run on the CPUs of producer_cpus (a list like "0-7,16-23",
+    None: any) that are not in reserved_cpus (e.g. those of the trainer's
+    input threads), on NUMA node numa_node (None: any), where the shared
+    buffer is then allocated too. pin_producers gives every producer a CPU
+    of its own. """
     mtsi_lib = get_mts_interface_lib()
     config_file_b = config_file.encode('utf-8')
-    config_file_p = c.create_string_buffer(config_file)
-    mts_buff = mtsi_lib.mts_init(config_file_b, num_producers)
+    mts_buff = placed_producers(mtsi_lib, config_file_b, num_producers,
+                                num_consumers, producer_cpus, reserved_cpus,
+                                numa_node, pin_producers)
+    path = c.create_string_buffer(64)
+    mtsi_lib.get_shared_path(path, len(path))
+    return sample_generator(mtsi_lib, mts_buff), path.value.decode('utf-8')
+
+
+def attached_data_generator(shared_path, consumer, bg_features=False):
+    """ Generator of the share of samples of consumer, from the producers
+    started by shared_producers in another process (bg_features as in
+    sample_generator) """
+    mtsi_lib = get_mts_interface_lib()
+    mts_buff = mtsi_lib.mts_attach(shared_path.encode('utf-8'), consumer)
+    if not mts_buff:
+        raise RuntimeError("Could not attach to %s as consumer %d"
+                           % (shared_path, consumer))
+    return sample_generator(mtsi_lib, mts_buff, bg_features)
+
 
+def sample_generator(mtsi_lib, mts_buff, bg_features=False):
+    """ Generator of the samples of an MTS_Buff. With bg_features, every
+    sample also comes with the bit masks of the background features drawn
+    and of those left out for the time budget, numbered as in
+    MTSSampleInfo (map_text_synthesizer.hpp) """
     while True:
-        ptr = c.c_void_p(mtsi_lib.get_sample(mts_buff))
+        # Image is a view into shared memory, so copy it (the only copy)
+        # before giving the space back
+        ptr = c.c_void_p(mtsi_lib.acquire_sample(mts_buff))
         (caption, image) = format_sample(mtsi_lib, ptr)
         image_cpy = image.copy()
-        yield caption, image_cpy
-        mtsi_lib.free_sample(ptr)
+        if bg_features:
+            features = (mtsi_lib.get_bg_features(ptr),
+                        mtsi_lib.get_dropped_bg_features(ptr))
+        mtsi_lib.release_sample(mts_buff, ptr)
+        if bg_features:
+            yield caption, image_cpy, features
+        else:
+            yield caption, image_cpy
+
+
+def batched_data_generator(config_file, num_producers, batch_size,
+                           height, max_width, normalize=False, prefetch=0,
+                           release_gil=True):
+    """ Generator of zero-padded batches, assembled in C.
+    Yields captions (list of batch_size strings), images
+    ([batch_size, height, max_width, 1] uint8, or float32 in [0,1] if
+    normalize) and widths ([batch_size] int32). Samples taller than height
+    or wider than max_width are skipped. """
+    mtsi_lib = get_mts_interface_lib(release_gil)
+    config_file_b = config_file.encode('utf-8')
+    mts_buff = mtsi_lib.mts_init(config_file_b, num_producers)
+    mts_buff = prefetched(mtsi_lib, mts_buff, prefetch)
+
+    dtype = np.float32 if normalize else np.uint8
+    fill_batch = mtsi_lib.get_batch_float if normalize else mtsi_lib.get_batch
+    labels = (c.c_char_p * batch_size)()
+
+    while True:
+        # Fresh arrays every batch, since they are handed to the caller
+        images = np.empty((batch_size, height, max_width, 1), dtype=dtype)
+        widths = np.empty((batch_size,), dtype=np.int32)
+
+        fill_batch(mts_buff, batch_size, height, max_width,
+                   images.ctypes.data, widths.ctypes.data, labels)
+        captions = [to_str(labels[i]) for i in range(batch_size)]
+        mtsi_lib.free_labels(labels, batch_size)
+
+        yield captions, images, widths
 
 
 def data_generator(config_file):
@@ -141,4 +311,4 @@ def test_generator(num_values=10, show_images=False,
     
     if log_time:
         end_time = time.time()
-        print "Time: ", end_time-start_time
+        print("Time: ", end_time-start_time)
@@ -0,0 +1,50 @@
+#ifndef MTS_DLPACK_H
+#define MTS_DLPACK_H
+
+/* The part of DLPack (github.com/dmlc/dlpack, ABI of version 0.8) needed
+ * to hand tensors to other frameworks: PyTorch, JAX, TensorFlow and
+ * CuPy all import a DLManagedTensor from a PyCapsule named "dltensor". */
+
+#include <stdint.h>
+
+#define DLPACK_VERSION 80
+
+typedef enum {
+  kDLCPU = 1,
+} DLDeviceType;
+
+typedef struct {
+  DLDeviceType device_type;
+  int32_t device_id;
+} DLDevice;
+
+typedef enum {
+  kDLInt = 0,
+  kDLUInt = 1,
+  kDLFloat = 2,
+} DLDataTypeCode;
+
+typedef struct {
+  uint8_t code;    // DLDataTypeCode
+  uint8_t bits;
+  uint16_t lanes;  // 1 for scalars
+} DLDataType;
+
+typedef struct {
+  void* data;
+  DLDevice device;
+  int32_t ndim;
+  DLDataType dtype;
+  int64_t* shape;
+  int64_t* strides;  // NULL: compact and row-major
+  uint64_t byte_offset;
+} DLTensor;
+
+// Whoever ends up with it calls deleter(self) once done with the data
+typedef struct DLManagedTensor {
+  DLTensor dl_tensor;
+  void* manager_ctx;
+  void (*deleter)(struct DLManagedTensor* self);
+} DLManagedTensor;
+
+#endif
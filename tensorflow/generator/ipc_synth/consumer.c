@@ -3,120 +3,215 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
 #include <signal.h>
 #include <unistd.h>
-#include <linux/membarrier.h>
 
 #include "prod_cons.h"
 #include "ipc_consumer.h"
 
-/* Consume next available sample and return pointer to heap allocated sample */
-sample_t* consume(intptr_t buff, uint64_t* consume_offset,
-		  int semid, uint32_t* have_buff_lock) {
+/* Point view at the next available sample of ring, without copying it.
+   Returns 0 if there is nothing to consume */
+int acquire(ring_t* ring, sample_view_t* view) {
 
-  /* For wrapping -- test to see if producer wrapped */
-  if(*consume_offset + BASE_CHUNK_SIZE >= SHM_SIZE
-     || *(uint64_t*)(buff + *consume_offset) == NO_SPACE_TO_PRODUCE) {
-    *consume_offset = START_BUFF_OFFSET;
+  /* Nothing available to consume */
+  record_header_t* rec = (record_header_t*)ring_peek(ring);
+  if(rec == NULL) {
+    return 0;
   }
 
-  /* Nothing available to consume, return NULL */
-  if(*(uint64_t*)(buff + *consume_offset) != SHOULD_CONSUME) {
-    return NULL;
+  // Ensure this really is a record we know how to read
+  if(rec->magic != RECORD_MAGIC || rec->version != RECORD_VERSION) {
+    fprintf(stderr,
+	    "invalid record in ring %lu: magic=%x, version=%u\n",
+	    ring->index, rec->magic, rec->version);
+    exit(1);
+  }
+  if((rec->flags & RECORD_FLAG_CHECKSUM)
+     && record_checksum(rec) != rec->checksum) {
+    fprintf(stderr,
+	    "checksum mismatch in ring %lu, record %lu\n",
+	    ring->index, rec->seq);
+  }
+
+  // Records of a ring are numbered consecutively, across producer restarts
+  if(rec->seq != ring->read_seq) {
+    fprintf(stderr,
+	    "ring %lu: expected record %lu, got record %lu\n",
+	    ring->index, ring->read_seq, rec->seq);
+  }
+  ring->read_seq = rec->seq + 1;
+
+  // Instantiate view according to the record header
+  view->sample.img_data = record_image(rec);
+  view->sample.height = rec->height;
+  view->sample.width = rec->width;
+  view->sample.caption = record_label(rec);
+  view->sample.bg_features = rec->bg_features;
+  view->sample.dropped_bg_features = rec->dropped_bg_features;
+  view->stride = rec->stride;
+  view->ring = (uint32_t)ring->index;
+  view->record = rec;
+
+  // Record is handed out, but its space stays in use until released
+  ring_advance(ring, rec->rec_len);
+
+  return 1;
+}
+
+/* Give the space of every released record at the tail back to the producer */
+void reclaim(ring_t* ring) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  uint64_t read = __atomic_load_n(&ring->read, __ATOMIC_RELAXED);
+  uint64_t freed = 0;
+
+  while(tail + freed != read) {
+    record_header_t* rec = (record_header_t*)ring_at(ring, tail + freed);
+
+    if(*(uint64_t*)rec == NO_SPACE_TO_PRODUCE) {
+      // Wrap padding can go as soon as it is reached
+      freed += ring->size - (tail + freed) % ring->size;
+    } else if(rec->flags & RECORD_FLAG_RELEASED) {
+      freed += rec->rec_len;
+    } else {
+      // Oldest record is still held by the caller
+      break;
+    }
   }
 
-  /* Light memory fencing to ensure appropriate 
-     memory access ordering @ runtime*/
-  asm volatile ("mfence" ::: "memory");
-  
-  /* Cache initial buff value */
-  intptr_t start_buff = buff;
-  
-  /* Jump to the next available element (8 is to skip past `ABLE_TO_CONSUME`) */
-  buff += *consume_offset + sizeof(uint64_t);
-  
+  if(freed > 0) {
+    ring_release(ring, freed);
+  }
+}
+
+/* Exposed via ipc_consumer.h -- attach consumer */
+int ipc_attach_consumer(void* buff, uint32_t consumer) {
+  if(consumer >= get_num_consumers(buff) || !attach_consumer(buff, consumer)) {
+    return 0;
+  }
+
+  // Records a consumer that died was still holding are dropped, so their
+  // space isn't lost for good
+  ipc_drop_held_samples(buff, consumer);
+  return 1;
+}
+
+/* Exposed via ipc_consumer.h -- drop held samples */
+void ipc_drop_held_samples(void* buff, uint32_t consumer) {
+  for(uint32_t p = 0; p < get_num_producers(buff); p++) {
+    ring_t* ring = get_producer_ring(buff, p, consumer);
+    uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint64_t read = __atomic_load_n(&ring->read, __ATOMIC_RELAXED);
+
+    while(pos != read) {
+      record_header_t* rec = (record_header_t*)ring_at(ring, pos);
+      if(*(uint64_t*)rec == NO_SPACE_TO_PRODUCE) {
+	pos += ring->size - pos % ring->size;
+      } else {
+	rec->flags |= RECORD_FLAG_RELEASED;
+	pos += rec->rec_len;
+      }
+    }
+    reclaim(ring);
+  }
+}
+
+/* Exposed via ipc_consumer.h -- acquire sample */
+int ipc_acquire_sample(void* buff, uint32_t consumer, uint32_t* next_producer,
+		       sample_view_t* view) {
+  uint32_t num_producers = get_num_producers(buff);
+
+  // Visit the consumer's ring of every producer once, starting after the
+  // one consumed from last
+  for(uint32_t i = 0; i < num_producers; i++) {
+    uint32_t producer = (*next_producer + i) % num_producers;
+    if(acquire(get_producer_ring(buff, producer, consumer), view)) {
+      *next_producer = (producer + 1) % num_producers;
+      consumer_count_sample(buff, consumer,
+			    ((record_header_t*)view->record)->rec_len);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Exposed via ipc_consumer.h -- release sample */
+void ipc_release_sample(void* buff, sample_view_t* view) {
+  // Mark the record as done with
+  ((record_header_t*)view->record)->flags |= RECORD_FLAG_RELEASED;
+
+  reclaim(get_ring(buff, view->ring));
+}
+
+/* Exposed via ipc_consumer.h -- copy sample */
+sample_t* ipc_copy_sample(const sample_view_t* view) {
   sample_t* spl = (sample_t*)malloc(sizeof(sample_t));
   if(spl == NULL) {
     perror("malloc");
     exit(1);
   }
 
-  // Stored as 64 bit int for mem alignment's sake, but don't need 64 bits
-  uint32_t height = (uint32_t)*((uint64_t*)buff);
-  buff += sizeof(uint64_t);
-
-  // Extract label from data chunk
-  char* label = strdup((char*)buff);
-  if(label == NULL) {
+  // Copy the sample out of the ring (packing the rows)
+  size_t sz = view->sample.height * view->sample.width;
+  spl->height = view->sample.height;
+  spl->width = view->sample.width;
+  spl->bg_features = view->sample.bg_features;
+  spl->dropped_bg_features = view->sample.dropped_bg_features;
+  spl->caption = strdup(view->sample.caption);
+  if(spl->caption == NULL) {
     perror("strdup");
     exit(1);
   }
-
-  // Label is hardcoded to be max MAX_WORD_LENGTH chars
-  buff += (MAX_WORD_LENGTH + 1)*sizeof(char);
-
-  // Extract size and update buff
-  uint64_t sz = *((uint64_t*)buff);
-  buff += sizeof(uint64_t);
-
-  // Allocate enough space to store flat image
-  unsigned char* img_flat = (unsigned char*)malloc(sz);
-  if(img_flat == NULL) {
+  spl->img_data = (unsigned char*)malloc(sz);
+  if(spl->img_data == NULL) {
     perror("malloc");
     fprintf(stderr, "Requested %lu bytes.\n", sz);
     exit(1);
   }
+  for(size_t r = 0; r < view->sample.height; r++) {
+    memcpy(spl->img_data + r*view->sample.width,
+	   view->sample.img_data + r*view->stride, view->sample.width);
+  }
 
-  // Copy image data into img_flat
-  memcpy(img_flat, (void*)buff, sz);
-  buff += sz*sizeof(unsigned char);
+  return spl;
+}
 
-  // Instantiate spl according to extracted values
-  spl->height = height;
+/* Exposed via ipc_consumer.h -- get sample */
+sample_t* ipc_get_sample(void* buff, uint32_t consumer,
+			 uint32_t* next_producer) {
+  sample_view_t view;
+  if(!ipc_acquire_sample(buff, consumer, next_producer, &view)) {
+    return NULL;
+  }
+
+  sample_t* spl = ipc_copy_sample(&view);
+  ipc_release_sample(buff, &view);
 
-  // Ensure no funny business with image height/img_size relationship
-  if(sz % height != 0) {
-    fprintf(stderr,
-	    "invalid image dimensions. size=%lu, height=%u\n",
-	    sz, height);
-  }
-  
-  spl->width = sz/height; //should be evenly divisible
-  spl->caption = label;
-  spl->img_data = img_flat;
-  
-  if(*consume_offset % 8 != 0 &&
-     *consume_offset + (*consume_offset % 8) < SHM_SIZE) {
-    *consume_offset += *consume_offset % 8;
-  }
-
-  // Buff is now consumed!
-  memset((void*)(start_buff+*consume_offset), 1, buff-(start_buff+*consume_offset));
-  //*(uint64_t*)(start_buff+*consume_offset) = (uint64_t)ALREADY_CONSUMED;
-
-  // Update consume_offset (local)
-  *consume_offset = buff - start_buff;
-  
-  // Update the consume_offset (visible to producers)
-  *((uint64_t*)(start_buff+sizeof(uint64_t))) = *consume_offset;
-  
   return spl;
 }
 
-/* Exposed via mts_ipc.h -- get sample */
-sample_t* ipc_get_sample(void* buff, uint64_t* consume_offset,
-		 int semid, uint32_t* have_buff_lock) {
+/* Exposed via ipc_consumer.h -- copy sample into batch */
+int ipc_copy_to_batch(const sample_view_t* view, int height, int max_width,
+		      unsigned char* out_image, float* out_image_float) {
+  size_t h = view->sample.height;
+  size_t w = view->sample.width;
 
-  sample_t* spl = consume((intptr_t)buff, consume_offset,
-			  semid, have_buff_lock);
-  
-  // If this happens, then something broke
-  if(*consume_offset > SHM_SIZE) {
-    fprintf(stderr, "Consumer did not wrap appropriately.\n");
-    exit(1);
+  if(h > (size_t)height || w > (size_t)max_width) {
+    return 0;
   }
 
-  return spl;
+  // Rows and columns past the sample are left as they are (zero padding)
+  for(size_t r = 0; r < h; r++) {
+    const unsigned char* src = view->sample.img_data + r*view->stride;
+    if(out_image != NULL) {
+      memcpy(out_image + r*max_width, src, w);
+    } else {
+      float* dst = out_image_float + r*max_width;
+      for(size_t c = 0; c < w; c++) {
+	dst[c] = src[c] / 255.0f;
+      }
+    }
+  }
+
+  return 1;
 }
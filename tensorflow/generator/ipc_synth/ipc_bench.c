@@ -0,0 +1,265 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/wait.h>
+
+#include "prod_cons.h"
+#include "ipc_consumer.h"
+#include "mts_ipc.h"
+
+/* Benchmark of the IPC transport alone: producers write synthetic fixed
+ * size samples instead of rendering them, so the consumer sees how fast
+ * samples can be moved for a given producer count and ring size. The
+ * master execs this same binary as its producers. */
+
+// Samples consumed before measuring (rings fill, producers settle)
+#define WARMUP_SAMPLES 1000
+
+#define MAX_CONFIGS 16
+
+/* Monotonic time in s */
+double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parse a "WxH" payload size */
+int parse_size(const char* spec, uint32_t* width, uint32_t* height) {
+  return sscanf(spec, "%ux%u", width, height) == 2 && *width > 0
+    && *height > 0;
+}
+
+/* Parse a comma separated list of up to MAX_CONFIGS numbers */
+int parse_list(const char* spec, uint64_t* values) {
+  int n = 0;
+  char* end;
+  while(n < MAX_CONFIGS) {
+    values[n++] = strtoull(spec, &end, 10);
+    if(*end != ',') {
+      break;
+    }
+    spec = end + 1;
+  }
+  return n;
+}
+
+/* Producer side: publish payload sized samples as fast as the rings take
+ * them (runs as "ipc_bench WxH producer seed", started by the master) */
+void produce_synthetic(const char* payload, uint32_t producer) {
+  uint32_t width, height;
+  if(!parse_size(payload, &width, &height)) {
+    fprintf(stderr, "ipc_bench: bad payload size %s\n", payload);
+    exit(1);
+  }
+
+  void* buff = get_shared_buff();
+  ring_t* lead = get_producer_ring(buff, producer, 0);
+  ring_take_over(lead);
+
+  const char* label = "ipc_bench";
+  uint32_t label_len = strlen(label);
+  uint64_t rec_len = record_size(label_len, width, height);
+
+  while(1) {
+    ring_wait_while_parked(lead);
+
+    ring_t* ring = ring_select(lead, rec_len);
+    record_header_t* rec = ring != NULL ?
+      (record_header_t*)ring_reserve(ring, rec_len) : NULL;
+    if(rec == NULL) {
+      fprintf(stderr, "ipc_bench: a %ux%u sample does not fit in a ring\n",
+	      width, height);
+      exit(1);
+    }
+
+    rec->magic = RECORD_MAGIC;
+    rec->version = RECORD_VERSION;
+    rec->flags = 0;
+    rec->rec_len = (uint32_t)rec_len;
+    rec->width = width;
+    rec->height = height;
+    rec->stride = width;
+    rec->label_len = label_len;
+    rec->checksum = 0;
+    rec->seq = ring->next_seq;
+    rec->bg_features = 0;
+    rec->dropped_bg_features = 0;
+    memcpy(record_label(rec), label, label_len + 1);
+
+    // Write every byte, as a producer copying out a rendered image would
+    memset(record_image(rec), (int)(rec->seq & 0xff), (size_t)width*height);
+
+    ring->next_seq++;
+    ring_commit(ring, rec_len);
+  }
+}
+
+/* Upper bound of a wait histogram bucket in us */
+uint64_t bucket_us(int bucket) {
+  return (uint64_t)1 << bucket;
+}
+
+/* Smallest bucket bound that at least fraction of the samples waited
+ * less than */
+uint64_t wait_percentile_us(const uint64_t* hist, uint64_t total,
+			    double fraction) {
+  uint64_t seen = 0;
+  for(int i = 0; i < MTS_IPC_WAIT_BUCKETS; i++) {
+    seen += hist[i];
+    if(seen >= fraction * total) {
+      return bucket_us(i);
+    }
+  }
+  return bucket_us(MTS_IPC_WAIT_BUCKETS - 1);
+}
+
+/* Consumer side: measure one configuration (in a child process, so that
+ * its producers go away with it) */
+void run_config(const char* self, const char* payload, int num_producers,
+		uint64_t shm_size_mb, long num_samples, int zero_copy) {
+  mts_ipc_opts_t opts;
+  mts_ipc_default_opts(&opts);
+  opts.num_producers = num_producers;
+  opts.shm_size_mb = shm_size_mb;
+  opts.config_file = payload;
+  opts.producer_path = self;
+  opts.zygote = 0;
+  mts_ipc_init_opts(&opts);
+
+  sample_view_t view;
+  for(long i = 0; i < WARMUP_SAMPLES; i++) {
+    mts_ipc_acquire_sample(&view);
+    mts_ipc_release_sample(&view);
+  }
+  uint64_t hist[MTS_IPC_WAIT_BUCKETS];
+  mts_ipc_wait_histogram(hist, 1);
+
+  uint64_t bytes = 0;
+  double start = now_s();
+  for(long i = 0; i < num_samples; i++) {
+    if(zero_copy) {
+      mts_ipc_acquire_sample(&view);
+      bytes += view.sample.height * view.sample.width;
+      mts_ipc_release_sample(&view);
+    } else {
+      sample_t* spl = (sample_t*)mts_ipc_get_sample();
+      bytes += spl->height * spl->width;
+      free(spl->img_data);
+      free(spl->caption);
+      free(spl);
+    }
+  }
+  double elapsed = now_s() - start;
+  mts_ipc_wait_histogram(hist, 0);
+
+  printf("%9d %7lu %8lu %11.0f %9.1f %8lu %8lu %8lu\n",
+	 num_producers, shm_size_mb,
+	 ((shm_header_t*)mts_ipc_get_buff())->ring_size / 1024,
+	 num_samples / elapsed, bytes / elapsed / 1048576,
+	 wait_percentile_us(hist, num_samples, 0.5),
+	 wait_percentile_us(hist, num_samples, 0.99),
+	 wait_percentile_us(hist, num_samples, 1.0));
+
+  // Full histogram of the time mts_ipc_get_sample spent waiting
+  for(int i = 0; i < MTS_IPC_WAIT_BUCKETS; i++) {
+    if(hist[i] != 0) {
+      printf("          wait < %8lu us: %10lu (%5.1f%%)\n",
+	     bucket_us(i), hist[i], 100.0 * hist[i] / num_samples);
+    }
+  }
+  fflush(stdout);
+}
+
+void usage(void) {
+  fprintf(stderr,
+	  "usage: ipc_bench [-p producers,...] [-m shm_size_mb,...] [-s WxH]\n"
+	  "                 [-n samples] [-z]\n"
+	  "  -p  producer counts to try (default 1,2,4)\n"
+	  "  -m  shared buffer sizes to try (default 64,1024)\n"
+	  "  -s  payload image size (default 256x32)\n"
+	  "  -n  samples measured per configuration (default 200000)\n"
+	  "  -z  acquire/release samples instead of copying them out\n");
+  exit(1);
+}
+
+/*
+ * Example usage :
+ * ./ipc_bench
+ * ./ipc_bench -p 1,2,4,8 -m 16,256 -s 1024x64 -n 50000
+ */
+int main(int argc, char* argv[]) {
+  // Started by the master as a producer
+  if(argc == 4 && getenv(SHM_FD_ENV) != NULL) {
+    produce_synthetic(argv[1], (uint32_t)atoi(argv[2]));
+    return 0;
+  }
+
+  uint64_t producers[MAX_CONFIGS] = { 1, 2, 4 };
+  int num_producer_configs = 3;
+  uint64_t sizes[MAX_CONFIGS] = { 64, 1024 };
+  int num_size_configs = 2;
+  const char* payload = "256x32";
+  long num_samples = 200000;
+  int zero_copy = 0;
+
+  int opt;
+  while((opt = getopt(argc, argv, "p:m:s:n:z")) != -1) {
+    switch(opt) {
+    case 'p': num_producer_configs = parse_list(optarg, producers); break;
+    case 'm': num_size_configs = parse_list(optarg, sizes); break;
+    case 's': payload = optarg; break;
+    case 'n': num_samples = atol(optarg); break;
+    case 'z': zero_copy = 1; break;
+    default: usage();
+    }
+  }
+  uint32_t width, height;
+  if(optind != argc || !parse_size(payload, &width, &height)
+     || num_samples <= 0) {
+    usage();
+  }
+
+  // Producers are this binary, wherever it was started from
+  char self[4096];
+  ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if(len == -1) {
+    perror("readlink");
+    exit(1);
+  }
+  self[len] = '\0';
+
+  printf("payload %s (%lu byte records), %ld samples, %s\n", payload,
+	 record_size(strlen("ipc_bench"), width, height), num_samples,
+	 zero_copy ? "zero-copy" : "copied out");
+  printf("producers  shm_mb  ring_kb   samples/s      MB/s  p50_wait p99_wait max_wait\n"
+	 "                                                   (upper bounds, in us)\n");
+  fflush(stdout);
+
+  for(int s = 0; s < num_size_configs; s++) {
+    for(int p = 0; p < num_producer_configs; p++) {
+      pid_t pid = fork();
+      if(pid == -1) {
+	perror("fork");
+	exit(1);
+      } else if(pid == 0) {
+	run_config(self, payload, (int)producers[p], sizes[s], num_samples,
+		   zero_copy);
+	exit(0);
+      }
+
+      int wstatus;
+      waitpid(pid, &wstatus, 0);
+      if(!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+	fprintf(stderr, "ipc_bench: %lu producers, %lu MB failed\n",
+		producers[p], sizes[s]);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -9,9 +9,49 @@ typedef struct sample {
   size_t height;
   size_t width;
   char* caption;
+  uint32_t bg_features;          // background features drawn (bit mask)
+  uint32_t dropped_bg_features;  // ones left out for the time budget
 } sample_t;
 
-sample_t* ipc_get_sample(void* buff, uint64_t* consume_offset,
-			 int semid, uint32_t* have_buff_lock);
+// A sample that still lives in shared memory. Starts with a sample_t
+// (pointing into the ring) so it can be used wherever a sample_t is read.
+typedef struct sample_view {
+  sample_t sample;
+  size_t stride;  // bytes between image rows
+  uint32_t ring;
+  void* record;
+} sample_view_t;
+
+// Become consumer number consumer of the shared buff (dropping whatever
+// samples a previous, dead, one did not release).
+// Returns 0 if it is out of range or taken by a live process
+int ipc_attach_consumer(void* buff, uint32_t consumer);
+
+// Release every sample consumer has acquired but not released
+void ipc_drop_held_samples(void* buff, uint32_t consumer);
+
+// Round-robin over the producers' rings of consumer, next_producer is where
+// to start looking.
+// Returns a heap allocated copy of the sample, or NULL if there is none
+sample_t* ipc_get_sample(void* buff, uint32_t consumer,
+			 uint32_t* next_producer);
+
+// Like ipc_get_sample, but fills in view without copying.
+// Returns 0 if there is no sample
+int ipc_acquire_sample(void* buff, uint32_t consumer, uint32_t* next_producer,
+		       sample_view_t* view);
+
+// Let the producer reuse the space of an acquired sample
+void ipc_release_sample(void* buff, sample_view_t* view);
+
+// Make a heap allocated copy of an acquired sample
+sample_t* ipc_copy_sample(const sample_view_t* view);
+
+// Copy a sample into one zero-initialized [height, max_width, 1] slot of a
+// batch, as uint8 into out_image or, if that is NULL, as floats scaled to
+// [0,1] into out_image_float. Returns 0 (copying nothing) if the sample is
+// taller than height or wider than max_width
+int ipc_copy_to_batch(const sample_view_t* view, int height, int max_width,
+		      unsigned char* out_image, float* out_image_float);
 
 #endif
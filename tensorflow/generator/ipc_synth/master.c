@@ -1,4 +1,6 @@
+#define _GNU_SOURCE  // sched_setaffinity
 #include <errno.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,221 +9,1160 @@
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <math.h>
+
+#include <fcntl.h>
 
 #include <sys/wait.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 
 #include "prod_cons.h"
 #include "ipc_consumer.h"
 #include "mts_ipc.h"
 
 /* Necessary if we(I) don't want to make another class... */
+int g_shm_fd;
 void* g_buff;
-int  g_semid;
-uint32_t  g_have_buff_lock;
-uint64_t  g_consume_offset;
+uint32_t  g_consumer;       // which of the buffer's consumers this process is
+uint32_t  g_next_producer;
 
-/* For respawning producers via signal handler */
-char* g_config_file; 
-int g_num_producers;
+/* For respawning producers */
+mts_ipc_opts_t g_opts;
+pid_t* g_producer_pids; // pid of each producer, by the rings it writes
+pid_t* g_retiring_pids; // replaced producer of each slot, until reaped
+uint64_t g_next_seed;   // seed of the next producer spawned
 
-/* Fork & exec a single producer */
-void fork_and_exec_producer(const char* config_file) {
-  int fstatus = fork();
-  if(fstatus == -1) {
+/* Set by the signal handlers, acted on by check_producers */
+volatile sig_atomic_t g_child_exited;        // SIGCHLD since the last reap
+volatile sig_atomic_t* g_recycle_requested;  // producer that sent SIGUSR1
+volatile sig_atomic_t g_recycle_pending;     // any of g_recycle_requested
+
+/* Handlers replaced by init_producer_respawn, put back by mts_ipc_cleanup */
+struct sigaction g_old_sigchld;
+struct sigaction g_old_sigusr1;
+
+/* Autoscaling state of each producer's slot (NULL in processes that
+ * attached to a buffer another process supervises) */
+#define SLOT_FREE 0    // no producer
+#define SLOT_ACTIVE 1  // producer running
+#define SLOT_PARKED 2  // producer sleeping until unparked
+int* g_slot_state;
+uint64_t* g_spawned_at;  // ns, when each slot's producer was started
+int g_num_slots;
+int g_num_active;
+
+/* Autoscaling measurements over the current window */
+uint64_t g_window_start; // ns
+uint64_t g_waited;       // ns the consumer slept in this window
+double g_min_fill;       // lowest fill of an active ring sampled from
+
+/* Wait histogram of g_consumer as of the last reset (see mts_ipc.h) */
+#if MTS_IPC_WAIT_BUCKETS != CONSUMER_WAIT_BUCKETS
+#error "the wait histogram of mts_ipc.h is the one of consumer_t"
+#endif
+uint64_t g_wait_hist_base[MTS_IPC_WAIT_BUCKETS];
+
+/* Counters for the metrics snapshot */
+uint64_t g_respawns;       // producers respawned after exiting
+uint64_t g_recycles;       // producers replaced through a handoff
+uint64_t g_hung_kills;     // producers killed for missing heartbeats
+
+/* Previous metrics snapshot, for rates over the interval since */
+uint64_t g_metrics_time;  // ns
+uint64_t* g_metrics_samples;  // samples of each producer slot
+uint64_t* g_metrics_consumed;        // samples acquired by each consumer
+uint64_t* g_metrics_consumed_bytes;  // bytes of their records
+uint64_t g_metrics_gen_hist[GEN_TIME_BUCKETS];
+
+/* CPUs producers run on (see the placement opts) */
+int g_place_producers;  // 0: producers run wherever this process may
+cpu_set_t g_producer_cpus;
+
+/* Zygote producer that new producers are forked from */
+pid_t g_zygote_pid;
+int g_zygote_sock = -1; // spawn requests out, producer pids back
+
+/* Monotonic time in ns */
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Parse a CPU list like "0-3,8,10-11" (the format of taskset -c and
+ * sysfs) into cpus, returns 0 if it isn't one */
+int parse_cpu_list(const char* list, cpu_set_t* cpus) {
+  CPU_ZERO(cpus);
+  while(*list != '\0' && *list != '\n') {
+    char* end;
+    long first = strtol(list, &end, 10);
+    long last = first;
+    if(end != list && *end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+    }
+    if(end == list || first < 0 || last < first || last >= CPU_SETSIZE
+       || (*end != ',' && *end != '\0' && *end != '\n')) {
+      return 0;
+    }
+    for(long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, cpus);
+    }
+    list = *end == ',' ? end + 1 : end;
+  }
+  return 1;
+}
+
+/* Read the CPUs of a NUMA node from sysfs, returns 0 on failure */
+int read_node_cpus(int node, cpu_set_t* cpus) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+	   node);
+  char list[4096];
+  FILE* file = fopen(path, "r");
+  int ok = file != NULL && fgets(list, sizeof(list), file) != NULL
+    && parse_cpu_list(list, cpus);
+  if(file != NULL) {
+    fclose(file);
+  }
+  return ok;
+}
+
+/* NUMA node the calling thread is running on (-1 if unknown) */
+int current_node(void) {
+  unsigned int cpu, node;
+  if(syscall(SYS_getcpu, &cpu, &node, NULL) == -1) {
+    return -1;
+  }
+  return (int)node;
+}
+
+/* Work out the CPUs producers may run on from the placement opts */
+void init_placement(void) {
+  g_place_producers = g_opts.producer_cpus != NULL
+    || g_opts.producer_node >= 0 || g_opts.reserved_cpus != NULL
+    || g_opts.pin_producers;
+  if(!g_place_producers) {
+    return;
+  }
+
+  if(g_opts.producer_cpus == NULL) {
+    if(sched_getaffinity(0, sizeof(g_producer_cpus), &g_producer_cpus)) {
+      perror("sched_getaffinity");
+      exit(1);
+    }
+  } else if(!parse_cpu_list(g_opts.producer_cpus, &g_producer_cpus)) {
+    fprintf(stderr, "MTS IPC: bad producer_cpus \"%s\".\n",
+	    g_opts.producer_cpus);
     exit(1);
-  } else if(fstatus == 0) {
+  }
 
-    // Send SIGHUP to this process when parent dies
-    prctl(PR_SET_PDEATHSIG, SIGHUP);
+  if(g_opts.producer_node >= 0) {
+    cpu_set_t node_cpus;
+    if(!read_node_cpus(g_opts.producer_node, &node_cpus)) {
+      fprintf(stderr, "MTS IPC: can't read the CPUs of NUMA node %d.\n",
+	      g_opts.producer_node);
+      exit(1);
+    }
+    CPU_AND(&g_producer_cpus, &g_producer_cpus, &node_cpus);
+  }
 
-    // Producer leaks memory, so make it crash by limiting heap
-    // (and saving the rest of the system processes)
+  if(g_opts.reserved_cpus != NULL) {
+    cpu_set_t reserved;
+    if(!parse_cpu_list(g_opts.reserved_cpus, &reserved)) {
+      fprintf(stderr, "MTS IPC: bad reserved_cpus \"%s\".\n",
+	      g_opts.reserved_cpus);
+      exit(1);
+    }
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if(CPU_ISSET(cpu, &reserved)) {
+	CPU_CLR(cpu, &g_producer_cpus);
+      }
+    }
+  }
+
+  if(CPU_COUNT(&g_producer_cpus) == 0) {
+    fprintf(stderr, "MTS IPC: no CPU left for producers.\n");
+    exit(1);
+  }
+}
+
+/* CPU the producer of a slot is pinned to, dealt round-robin over the
+ * producer CPUs (-1: not pinned) */
+int producer_cpu(int producer) {
+  if(!g_opts.pin_producers) {
+    return -1;
+  }
+  int n = producer % CPU_COUNT(&g_producer_cpus);
+  for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if(CPU_ISSET(cpu, &g_producer_cpus) && n-- == 0) {
+      return cpu;
+    }
+  }
+  return -1;
+}
+
+/* Settings common to every process the master spawns, which runs on cpu
+ * (-1: any of the producer CPUs) */
+void prep_child(int cpu) {
+  // Send SIGHUP to this process when parent dies
+  prctl(PR_SET_PDEATHSIG, SIGHUP);
+
+  // Only this process tree can get at the shared buffer
+  pass_shared_fd(g_shm_fd);
+
+  // Keep it off the CPUs it shouldn't use, before it allocates anything
+  if(g_place_producers) {
+    cpu_set_t cpus = g_producer_cpus;
+    if(cpu >= 0) {
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+    }
+    if(sched_setaffinity(0, sizeof(cpus), &cpus)) {
+      exit(1);
+    }
+  }
+
+  // In case a producer leaks anyway, make it crash by limiting heap
+  // (and saving the rest of the system processes)
+  if(g_opts.data_limit_mb != 0) {
     struct rlimit data_limit;
-    data_limit.rlim_cur = PRODUCER_DATA_LIMIT;
-    data_limit.rlim_max = PRODUCER_DATA_LIMIT;
-    
+    data_limit.rlim_cur = g_opts.data_limit_mb * 1048576;
+    data_limit.rlim_max = g_opts.data_limit_mb * 1048576;
+
     if(setrlimit(RLIMIT_DATA, &data_limit)) {
       exit(1);
     }
+  }
+}
+
+/* Fork & exec a single producer that writes to the rings of producer */
+pid_t fork_and_exec_producer(const char* config_file, int producer,
+			     uint64_t seed) {
+  pid_t fstatus = fork();
+  if(fstatus == -1) {
+    exit(1);
+  } else if(fstatus == 0) {
+    prep_child(producer_cpu(producer));
     
     // Exec a new producer
-    char* args[3];
-    args[0] = "producer";
+    char producer_arg[16];
+    snprintf(producer_arg, sizeof(producer_arg), "%d", producer);
+    char seed_arg[24];
+    snprintf(seed_arg, sizeof(seed_arg), "%llu", (unsigned long long)seed);
+
+    char* args[5];
+    args[0] = (char*)g_opts.producer_path;
     args[1] = (char*)config_file;
-    args[2] = NULL;
+    args[2] = producer_arg;
+    args[3] = seed_arg;
+    args[4] = NULL;
 
     if(execvp(args[0], args)) {
       exit(1);
     }
   }
+  return fstatus;
 }
 
-/* Spawn producers */
-void fork_and_exec_producers(int num_producers, const char* config_file) {
-  for(int i = 0; i < num_producers; i++) {
-    fork_and_exec_producer(config_file);
-    // Sleep for a hot sec to avoid identically-seeded synthesizers
-    // (default seeds based on time in seconds, which is kinda lame)
-    sleep(1);
+/* Fork & exec the zygote, talking to it over a socket on its stdin/stdout */
+void fork_and_exec_zygote(const char* config_file) {
+  int socks[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, socks)) {
+    perror("socketpair");
+    exit(1);
   }
-}
 
-/* Fork & exec base */
-void fork_and_exec_base(int* pid) {
-  *pid = fork();
-  if(*pid == -1) {
-    // Failed
-    perror("base fork");
+  g_zygote_pid = fork();
+  if(g_zygote_pid == -1) {
+    perror("zygote fork");
     exit(1);
-  } else if(*pid == 0) {
-    // In forked ps...
-    
-    // Send SIGHUP to this process when parent dies
-    // (Shouldn't be necessary because this dies on its own pretty fast)
-    prctl(PR_SET_PDEATHSIG, SIGHUP);
-
-    // Prep args and exec `base`
-    char* args[2];
-    args[0] = "base";
-    args[1] = NULL;
+  } else if(g_zygote_pid == 0) {
+    // Producers it forks are pinned by the zygote, if at all
+    prep_child(-1);
+
+    close(socks[0]);
+    if(dup2(socks[1], STDIN_FILENO) == -1
+       || dup2(socks[1], STDOUT_FILENO) == -1) {
+      exit(1);
+    }
+    close(socks[1]);
+
+    char* args[4];
+    args[0] = (char*)g_opts.producer_path;
+    args[1] = "--zygote";
+    args[2] = (char*)config_file;
+    args[3] = NULL;
+
     if(execvp(args[0], args)) {
-      perror("exec base");
       exit(1);
     }
-  }   
+  }
+
+  close(socks[1]);
+  g_zygote_sock = socks[0];
+}
+
+/* Stop talking to a dead zygote (a new one is started on the next spawn) */
+void forget_zygote(void) {
+  if(g_zygote_sock != -1) {
+    close(g_zygote_sock);
+  }
+  g_zygote_sock = -1;
+  g_zygote_pid = 0;
+}
+
+/* Ask the zygote to fork a producer, returns its pid or -1 on failure */
+pid_t fork_from_zygote(int producer, uint64_t seed) {
+  if(g_zygote_pid == 0) {
+    fork_and_exec_zygote(g_opts.config_file);
+  }
+
+  spawn_request_t req;
+  memset(&req, 0, sizeof(req));
+  req.producer = producer;
+  req.cpu = producer_cpu(producer);
+  req.seed = seed;
+
+  // MSG_NOSIGNAL so a dead zygote doesn't take us down with SIGPIPE
+  pid_t pid;
+  if(send(g_zygote_sock, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)
+     || recv(g_zygote_sock, &pid, sizeof(pid), MSG_WAITALL) != sizeof(pid)) {
+    // Only known pids are reaped, so this one must be before it's forgotten
+    kill(g_zygote_pid, SIGKILL);
+    waitpid(g_zygote_pid, NULL, 0);
+    forget_zygote();
+    return -1;
+  }
+  return pid;
+}
+
+/* Start a producer that writes to the rings of producer, with a fresh seed */
+pid_t spawn_producer(int producer) {
+  uint64_t seed = g_next_seed++;
+  g_spawned_at[producer] = now_ns();
+
+  if(g_opts.zygote) {
+    pid_t pid = fork_from_zygote(producer, seed);
+    if(pid != -1) {
+      return pid;
+    }
+    fprintf(stderr, "MTS IPC: zygote failed, exec'ing producer instead\n");
+  }
+  return fork_and_exec_producer(g_opts.config_file, producer, seed);
 }
 
-/* NOTE: This assumes the only child processes are producers */
+/* Spawn producers into the first num_producers slots */
+void spawn_producers(int num_producers) {
+  for(int i = 0; i < num_producers; i++) {
+    g_producer_pids[i] = spawn_producer(i);
+    g_slot_state[i] = SLOT_ACTIVE;
+  }
+  g_num_active = num_producers;
+}
+
+/* Note that a child exited. Spawning isn't async-signal-safe, so the
+ * producer is reaped and replaced by the next check_producers */
 void dead_child_handler(int signo) {
+  (void)signo;
+  g_child_exited = 1;
+}
+
+/* Note that a producer is retiring (it exits once its replacement, started
+ * by the next check_producers, has taken over its rings) */
+void recycle_handler(int signo, siginfo_t* info, void* context) {
+  (void)signo;
+  (void)context;
+  for(int i = 0; i < g_num_slots; i++) {
+    if(g_slot_state[i] != SLOT_FREE && g_producer_pids[i] == info->si_pid) {
+      g_recycle_requested[i] = info->si_pid;
+      g_recycle_pending = 1;
+      break;
+    }
+  }
+}
+
+/* Reap a child if it has exited, returns whether it did. Only the
+ * producers and zygote are waited for, so other children of the process
+ * (and their exit statuses) are left to whoever started them */
+int reaped(pid_t pid) {
   int wstatus;
-  while(waitpid(0, &wstatus, WNOHANG || WEXITED || WUNTRACED) > 0) {
-    /* Not sure where to get this config file from?? */
-    fork_and_exec_producer(g_config_file);
-    sleep(1); // To avoid identically seeded producers
+  return pid > 0 && waitpid(pid, &wstatus, WNOHANG) == pid;
+}
+
+/* Replace the producers that exited or asked to be recycled since the last
+ * call, as noted by the signal handlers */
+void respawn_producers(void) {
+  if(g_child_exited) {
+    // Cleared first, so an exit during the scan is caught next time
+    g_child_exited = 0;
+
+    if(reaped(g_zygote_pid)) {
+      forget_zygote();
+    }
+    for(int i = 0; i < g_num_slots; i++) {
+      if(reaped(g_retiring_pids[i])) {
+	g_retiring_pids[i] = 0;
+      }
+      if(g_slot_state[i] != SLOT_FREE && reaped(g_producer_pids[i])) {
+	// A half-written chunk was never committed, so the rings are intact
+	// (a parked slot stays parked, so its new producer waits right away).
+	// A recycle request it made (its hand-off timed out) died with it
+	g_recycle_requested[i] = 0;
+	g_producer_pids[i] = spawn_producer(i);
+	g_respawns++;
+      }
+    }
+  }
+
+  if(!g_recycle_pending) {
+    return;
+  }
+  g_recycle_pending = 0;
+  for(int i = 0; i < g_num_slots; i++) {
+    if(g_recycle_requested[i]) {
+      pid_t requester = g_recycle_requested[i];
+      g_recycle_requested[i] = 0;
+      // Only the slot's current producer retires, so the slot never has
+      // two producers writing its rings
+      if(g_slot_state[i] != SLOT_FREE && requester == g_producer_pids[i]) {
+	// Its exit is expected, and only needs reaping. The next request
+	// can only come from the replacement, after the hand-off, so a slot
+	// has one retiring producer at a time
+	g_retiring_pids[i] = g_producer_pids[i];
+	g_producer_pids[i] = spawn_producer(i);
+	g_recycles++;
+      }
+    }
   }
 }
 
-/* Set up signal handler to spawn a producer when SIGCHLD is received */
+/* Set up signal handlers to note when a child exits (SIGCHLD), or when a
+ * producer asks to be recycled (SIGUSR1) */
 void init_producer_respawn(void) {
   struct sigaction sa;
   sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
+  sigaddset(&sa.sa_mask, SIGUSR1);
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
   sa.sa_handler = &dead_child_handler;
-  sigaction(SIGCHLD, &sa, NULL);
+  sigaction(SIGCHLD, &sa, &g_old_sigchld);
+
+  struct sigaction usr1;
+  sigemptyset(&usr1.sa_mask);
+  sigaddset(&usr1.sa_mask, SIGCHLD);
+  usr1.sa_flags = SA_RESTART | SA_SIGINFO;
+  usr1.sa_sigaction = &recycle_handler;
+  sigaction(SIGUSR1, &usr1, &g_old_sigusr1);
+}
+
+/* Terminate the producers and the zygote and wait for them to exit, then
+ * put back the signal handlers init_producer_respawn replaced */
+void stop_producers(void) {
+  for(int i = 0; i < g_num_slots; i++) {
+    if(g_producer_pids[i] > 0) {
+      kill(g_producer_pids[i], SIGTERM);
+    }
+    if(g_retiring_pids[i] > 0) {
+      kill(g_retiring_pids[i], SIGTERM);
+    }
+  }
+  if(g_zygote_pid > 0) {
+    kill(g_zygote_pid, SIGTERM);
+  }
+
+  // Only once they are gone, so a late recycle request finds our handler
+  // rather than SIGUSR1's default (which would take this process down)
+  for(int i = 0; i < g_num_slots; i++) {
+    if(g_producer_pids[i] > 0) {
+      waitpid(g_producer_pids[i], NULL, 0);
+    }
+    if(g_retiring_pids[i] > 0) {
+      waitpid(g_retiring_pids[i], NULL, 0);
+    }
+  }
+  if(g_zygote_pid > 0) {
+    waitpid(g_zygote_pid, NULL, 0);
+  }
+  forget_zygote();
+
+  sigaction(SIGCHLD, &g_old_sigchld, NULL);
+  sigaction(SIGUSR1, &g_old_sigusr1, NULL);
+  g_child_exited = 0;
+  g_recycle_pending = 0;
+
+  if(g_opts.zygote && prctl(PR_SET_CHILD_SUBREAPER, 0)) {
+    perror("prctl");
+  }
+}
+
+void mts_ipc_default_opts(mts_ipc_opts_t* opts) {
+  memset(opts, 0, sizeof(*opts));
+  opts->num_producers = 1;
+  opts->num_consumers = 1;
+  opts->producer_path = "producer";
+  opts->zygote = 1;
+  opts->scale_window_ms = 2000;
+  opts->scale_up_wait = 0.05;
+  opts->scale_down_fill = 0.5;
+  opts->recycle_rss_mb = 1024;
+  opts->data_limit_mb = PRODUCER_DATA_LIMIT / 1048576;
+  opts->heartbeat_timeout_ms = 30000;
+  opts->metrics_interval_ms = 10000;
+  opts->producer_node = -1;
+  opts->shm_node = -1;
+  opts->shm_size_mb = DEFAULT_SHM_SIZE / 1048576;
+}
+
+/* Start measuring a new autoscaling window */
+void reset_scale_window(void) {
+  g_window_start = now_ns();
+  g_waited = 0;
+  g_min_fill = 1.0;
+}
+
+/* Add a producer, unparking one if there is any */
+void scale_up(void) {
+  int slot = -1;
+  for(int i = 0; i < g_num_slots; i++) {
+    if(g_slot_state[i] == SLOT_PARKED) {
+      slot = i;
+      break;
+    } else if(g_slot_state[i] == SLOT_FREE && slot == -1) {
+      slot = i;
+    }
+  }
+
+  if(g_slot_state[slot] == SLOT_PARKED) {
+    ring_set_parked(get_producer_ring(g_buff, slot, 0), 0);
+  } else {
+    g_producer_pids[slot] = spawn_producer(slot);
+  }
+  g_slot_state[slot] = SLOT_ACTIVE;
+  g_num_active++;
+}
+
+/* Park the last active producer (its rings are still drained) */
+void scale_down(void) {
+  for(int i = g_num_slots - 1; i >= 0; i--) {
+    if(g_slot_state[i] == SLOT_ACTIVE) {
+      ring_set_parked(get_producer_ring(g_buff, i, 0), 1);
+      g_slot_state[i] = SLOT_PARKED;
+      g_num_active--;
+      return;
+    }
+  }
+}
+
+/* Account for a sample acquired from ring, then scale at the end of a
+ * window (only the consumer that started the producers does) */
+void autoscale(uint32_t ring) {
+  if(g_slot_state == NULL || g_opts.min_producers >= g_opts.max_producers) {
+    return;
+  }
+
+  ring_t* r = get_ring(g_buff, ring);
+  if(g_slot_state[r->producer] == SLOT_ACTIVE) {
+    double fill = (double)ring_fill(r) / r->size;
+    if(fill < g_min_fill) {
+      g_min_fill = fill;
+    }
+  }
+
+  uint64_t elapsed = now_ns() - g_window_start;
+  if(elapsed < (uint64_t)g_opts.scale_window_ms * 1000000) {
+    return;
+  }
+
+  if((double)g_waited / elapsed > g_opts.scale_up_wait
+     && g_num_active < g_opts.max_producers) {
+    scale_up();
+  } else if(g_min_fill >= g_opts.scale_down_fill
+	    && g_num_active > g_opts.min_producers) {
+    scale_down();
+  }
+  reset_scale_window();
+}
+
+/* Copy of an option string (NULL stays NULL), owned until
+ * free_opt_strings */
+const char* copy_opt_string(const char* str) {
+  if(str == NULL) {
+    return NULL;
+  }
+  char* copy = strdup(str);
+  if(copy == NULL) {
+    perror("strdup");
+    exit(1);
+  }
+  return copy;
+}
+
+/* Free the copies of the option strings made by mts_ipc_init_opts */
+void free_opt_strings(void) {
+  free((void*)g_opts.config_file);
+  free((void*)g_opts.producer_path);
+  free((void*)g_opts.metrics_path);
+  free((void*)g_opts.producer_cpus);
+  free((void*)g_opts.reserved_cpus);
+  g_opts.config_file = NULL;
+  g_opts.producer_path = NULL;
+  g_opts.metrics_path = NULL;
+  g_opts.producer_cpus = NULL;
+  g_opts.reserved_cpus = NULL;
 }
 
 /* Perform necessary operations for prepping IPC */
-void mts_ipc_init(int num_producers, const char* config_file) {
-  /* Prepare shared memory and semaphores */
-  pid_t pid;
-  int wstatus;
-  fork_and_exec_base(&pid);
+void mts_ipc_init_opts(const mts_ipc_opts_t* opts) {
+  g_opts = *opts;
 
-  // Wait until base terminates
-  waitpid(pid, &wstatus, WUNTRACED);
+  // Respawns read them long after this returns, and the caller's strings
+  // (e.g. of a Python bytes object) need not live that long
+  g_opts.config_file = copy_opt_string(opts->config_file);
+  g_opts.producer_path = copy_opt_string(opts->producer_path);
+  g_opts.metrics_path = copy_opt_string(opts->metrics_path);
+  g_opts.producer_cpus = copy_opt_string(opts->producer_cpus);
+  g_opts.reserved_cpus = copy_opt_string(opts->reserved_cpus);
+  if(g_opts.min_producers <= 0) {
+    g_opts.min_producers = g_opts.num_producers;
+  }
+  if(g_opts.max_producers <= 0) {
+    g_opts.max_producers = g_opts.num_producers;
+  }
+  if(g_opts.min_producers > g_opts.num_producers
+     || g_opts.num_producers > g_opts.max_producers) {
+    fprintf(stderr, "MTS IPC: need min_producers <= num_producers <= max_producers.\n");
+    exit(1);
+  }
+  if(g_opts.num_consumers <= 0) {
+    g_opts.num_consumers = 1;
+  }
+  init_placement();
+
+  /* Prepare shared memory with one ring per possible producer and
+   * consumer, this process being consumer 0 */
+  g_num_slots = g_opts.max_producers;
+  g_shm_fd = create_shared_fd(g_opts.shm_size_mb * 1048576, g_opts.huge_pages);
+  g_buff = map_shared_buff(g_shm_fd);
+  // What was mapped, rounded up to whole huge pages if they back it, so
+  // that every process unmaps all of it (see release_shared_buff)
+  uint64_t shm_size = shared_fd_size(g_shm_fd);
+  int shm_node = g_opts.shm_node == MTS_IPC_LOCAL_NODE ? current_node()
+    : g_opts.shm_node;
+  if(g_opts.shm_node != -1 && !bind_shared_buff(g_shm_fd, g_buff, shm_node)) {
+    fprintf(stderr, "MTS IPC: shared buffer not bound to NUMA node %d.\n",
+	    shm_node);
+  }
+  init_rings(g_buff, g_num_slots, g_opts.num_consumers, shm_size);
+  g_consumer = 0;
+  attach_consumer(g_buff, g_consumer);
 
   /* Deal with the inevitable crashing of producers */
-  g_config_file = (char*)config_file;
-  g_num_producers = num_producers;
+  g_next_seed = opts->seed != 0 ? opts->seed : (uint64_t)time(NULL);
+  g_producer_pids = (pid_t*)calloc(g_num_slots, sizeof(pid_t));
+  g_retiring_pids = (pid_t*)calloc(g_num_slots, sizeof(pid_t));
+  g_recycle_requested =
+    (volatile sig_atomic_t*)calloc(g_num_slots, sizeof(sig_atomic_t));
+  g_slot_state = (int*)calloc(g_num_slots, sizeof(int));
+  g_spawned_at = (uint64_t*)calloc(g_num_slots, sizeof(uint64_t));
+  g_metrics_samples = (uint64_t*)calloc(g_num_slots, sizeof(uint64_t));
+  g_metrics_consumed = (uint64_t*)calloc(g_opts.num_consumers,
+					 sizeof(uint64_t));
+  g_metrics_consumed_bytes = (uint64_t*)calloc(g_opts.num_consumers,
+					       sizeof(uint64_t));
+  if(g_producer_pids == NULL || g_retiring_pids == NULL
+     || g_recycle_requested == NULL || g_slot_state == NULL
+     || g_spawned_at == NULL || g_metrics_samples == NULL
+     || g_metrics_consumed == NULL || g_metrics_consumed_bytes == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+
+  // Producers forked by the zygote are orphaned on purpose; adopt them so
+  // their deaths are reported here
+  if(opts->zygote && prctl(PR_SET_CHILD_SUBREAPER, 1)) {
+    perror("prctl");
+    exit(1);
+  }
+
   init_producer_respawn();
-  
+
+  /* Recycling limits, read by the producers */
+  shm_header_t* header = (shm_header_t*)g_buff;
+  header->recycle_samples = g_opts.recycle_samples;
+  header->recycle_rss = (uint64_t)g_opts.recycle_rss_mb * 1048576;
+
   /* Start producers */
-  fork_and_exec_producers(num_producers, config_file);
+  spawn_producers(g_opts.num_producers);
 
   /* Prepare for consumption */
-  g_buff = (void*)((intptr_t)get_shared_buff(0));
-  g_semid = get_semaphores(0);
-  g_have_buff_lock = 0;
-  g_consume_offset = START_BUFF_OFFSET;
-
+  g_next_producer = 0;
+  reset_scale_window();
+  g_metrics_time = now_ns();
 }
 
-/* Print relevant information around consumer */
-void print_buff_around_consumer(FILE* log_file, int leading_bytes, int num_bytes) {
-  uint8_t* buff = (uint8_t*)((intptr_t)g_buff + g_consume_offset - leading_bytes);
-  fprintf(log_file,"----Printing %d leading bytes, and %d bytes total around problem area.----\n", leading_bytes, num_bytes);
+int mts_ipc_attach(const char* path, int consumer) {
+  g_shm_fd = open(path, O_RDWR | O_CLOEXEC);
+  if(g_shm_fd == -1) {
+    perror(path);
+    return 0;
+  }
+  g_buff = map_shared_buff(g_shm_fd);
 
-  for(int i = 1; i <= num_bytes; i++) {
-    fprintf(log_file, "%02x ", buff[i-1] & 0xff);
-    if(i % 8 == 0 && i != 0) {
-      fprintf(log_file, "\n");
-    }
+  if(!ipc_attach_consumer(g_buff, consumer)) {
+    fprintf(stderr, "MTS IPC: consumer %d of %s is out of range or taken.\n",
+	    consumer, path);
+    release_shared_buff(g_buff);
+    close(g_shm_fd);
+    return 0;
   }
-  
-  fprintf(log_file, "\n");
+
+  g_consumer = consumer;
+  g_next_producer = 0;
+  return 1;
+}
+
+int mts_ipc_shared_path(char* path, size_t len) {
+  return snprintf(path, len, "/proc/%d/fd/%d", (int)getpid(), g_shm_fd);
+}
+
+void mts_ipc_init(int num_producers, const char* config_file) {
+  mts_ipc_opts_t opts;
+  mts_ipc_default_opts(&opts);
+  opts.num_producers = num_producers;
+  opts.config_file = config_file;
+  mts_ipc_init_opts(&opts);
 }
 
 void print_failure_debug_info(FILE* log_file) {
   fprintf(log_file, "_________ENTRY________\n");
-  fprintf(log_file, "g_consume_offset: %lu\n", g_consume_offset);
-  fprintf(log_file, "buffer-local consume_offset: %lu\n", *(uint64_t*)((intptr_t)g_buff+8));
-  fprintf(log_file, "producer_offset: %lu\n", *(uint64_t*)g_buff);
+  fprintf(log_file, "g_next_producer: %u\n", g_next_producer);
 
-  print_buff_around_consumer(log_file, 8, 64);
+  for(uint32_t i = 0; i < get_num_rings(g_buff); i++) {
+    ring_t* ring = get_ring(g_buff, i);
+    ring_t* lead = ring_lead(ring);
+    fprintf(log_file, "ring %u (producer %u, consumer %u): producer pid %d "
+	    "(owner %u), state %d, heartbeat %lu ms ago, head %lu, tail %lu, "
+	    "next record %lu\n",
+	    i, ring->producer, ring->consumer,
+	    (int)g_producer_pids[ring->producer], lead->owner_pid,
+	    g_slot_state[ring->producer], ring_heartbeat_age_ms(lead),
+	    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE),
+	    __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE), ring->read_seq);
+  }
 }
 
-/* Soft reset for the MTS_IPC system -- Adds some light fault tolerance if necessary */
-void mts_ipc_reset(void) {
-  printf("NOTE: MTS IPC has been reset. If this is happening a lot,\
- this is probably indicative of something very not good. Ref /tmp/mts_ipc_crash.log for more relevant crash information. Feel free to send logs to gaffordb@grinnell.edu.\n");
+/* Respawn producers that exited or are retiring, and kill producers that
+ * have not shown signs of life for longer than the heartbeat timeout, they
+ * are then respawned like crashed ones. Records are only published whole,
+ * so nothing a hung producer left behind is ever read, and the other
+ * producers keep flowing in the meantime. Producers are only supervised by
+ * the process that started them. */
+void check_producers(void) {
+  static uint64_t last_check;
+  if(g_slot_state == NULL) {
+    return;
+  }
+  respawn_producers();
 
-  int semid = get_semaphores(0);
-  lock_buff(semid);
-  
-  FILE* log_file = fopen("/tmp/mts_ipc_crash.log", "a");
-  if(log_file == NULL) {
-    perror("fopen");
-    exit(1);
+  uint64_t now = now_ns();
+  if(g_opts.heartbeat_timeout_ms == 0
+     || now - last_check < (uint64_t)FUTEX_WAIT_TIMEOUT_MS * 1000000) {
+    return;
   }
-  print_failure_debug_info(log_file);
-  fclose(log_file);
-  
-  // Clear out memory and reset buffer-visible offsets
-  pid_t pid;
-  int wstatus;
-  fork_and_exec_base(&pid);
+  last_check = now;
+
+  for(int i = 0; i < g_num_slots; i++) {
+    if(g_slot_state[i] == SLOT_FREE) {
+      continue;
+    }
+
+    // A new producer may still be starting up, and hasn't beaten yet
+    uint64_t age_ms = ring_heartbeat_age_ms(get_producer_ring(g_buff, i, 0));
+    uint64_t started_ms = (now - g_spawned_at[i]) / 1000000;
+    if(age_ms > started_ms) {
+      age_ms = started_ms;
+    }
+
+    if(age_ms > (uint64_t)g_opts.heartbeat_timeout_ms) {
+      fprintf(stderr, "MTS IPC: producer %d of slot %d hung for %lu ms, killing it. Ref /tmp/mts_ipc_crash.log for more information.\n",
+	      (int)g_producer_pids[i], i, age_ms);
+
+      FILE* log_file = fopen("/tmp/mts_ipc_crash.log", "a");
+      if(log_file != NULL) {
+	print_failure_debug_info(log_file);
+	fclose(log_file);
+      }
+
+      // Don't kill it twice while its replacement starts
+      g_spawned_at[i] = now;
+      kill(g_producer_pids[i], SIGKILL);
+      g_hung_kills++;
+    }
+  }
+}
+
+/* Start a metric in Prometheus text format */
+void metric_header(FILE* file, const char* name, const char* type,
+		   const char* help) {
+  fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Write the buckets, sum and count of a log2 us histogram (time_bucket) as
+ * a Prometheus histogram in seconds */
+void metric_histogram(FILE* file, const char* name, const char* labels,
+		      const uint64_t* hist, int num_buckets, uint64_t total_ns) {
+  uint64_t count = 0;
+  for(int i = 0; i < num_buckets - 1; i++) {
+    count += hist[i];
+    fprintf(file, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels,
+	    labels[0] ? "," : "", (double)((uint64_t)1 << i) / 1e6, count);
+  }
+  count += hist[num_buckets - 1];
+  fprintf(file, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels,
+	  labels[0] ? "," : "", count);
+  fprintf(file, "%s_sum%s%s%s %.6f\n", name, labels[0] ? "{" : "", labels,
+	  labels[0] ? "}" : "", total_ns / 1e9);
+  fprintf(file, "%s_count%s%s%s %lu\n", name, labels[0] ? "{" : "", labels,
+	  labels[0] ? "}" : "", count);
+}
+
+/* Write a sample value, NaN the way Prometheus spells it */
+void metric_value(FILE* file, double value) {
+  if(isnan(value)) {
+    fprintf(file, " NaN\n");
+  } else {
+    fprintf(file, " %g\n", value);
+  }
+}
+
+/* Samples published by producer slot so far, over all of its rings */
+uint64_t producer_samples(int producer) {
+  uint64_t samples = 0;
+  for(uint32_t c = 0; c < get_num_consumers(g_buff); c++) {
+    ring_t* ring = get_producer_ring(g_buff, producer, c);
+    samples += __atomic_load_n(&ring->next_seq, __ATOMIC_RELAXED);
+  }
+  return samples;
+}
 
-  // Wait until base terminates
-  waitpid(pid, &wstatus, WUNTRACED);
+/* Write the metrics to the metrics file, through a temporary file so that
+ * readers never see half a snapshot */
+void write_metrics_file(double interval_s) {
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_opts.metrics_path);
+  FILE* file = fopen(tmp_path, "w");
+  if(file == NULL) {
+    perror(tmp_path);
+    return;
+  }
+
+  metric_header(file, "mts_ipc_producers", "gauge",
+		"Producer slots by state.");
+  int num_parked = 0;
+  for(int i = 0; i < g_num_slots; i++) {
+    num_parked += g_slot_state[i] == SLOT_PARKED;
+  }
+  fprintf(file, "mts_ipc_producers{state=\"active\"} %d\n", g_num_active);
+  fprintf(file, "mts_ipc_producers{state=\"parked\"} %d\n", num_parked);
+
+  metric_header(file, "mts_ipc_producer_samples_total", "counter",
+		"Samples published by each producer slot.");
+  for(int i = 0; i < g_num_slots; i++) {
+    fprintf(file, "mts_ipc_producer_samples_total{producer=\"%d\"} %lu\n",
+	    i, producer_samples(i));
+  }
+
+  metric_header(file, "mts_ipc_producer_samples_per_second", "gauge",
+		"Samples published by each producer slot per second, since the last snapshot.");
+  for(int i = 0; i < g_num_slots; i++) {
+    uint64_t samples = producer_samples(i);
+    fprintf(file, "mts_ipc_producer_samples_per_second{producer=\"%d\"} %.1f\n",
+	    i, (samples - g_metrics_samples[i]) / interval_s);
+    g_metrics_samples[i] = samples;
+  }
+
+  metric_header(file, "mts_ipc_ring_fill_ratio", "gauge",
+		"Fraction of each ring in use.");
+  for(uint32_t i = 0; i < get_num_rings(g_buff); i++) {
+    ring_t* ring = get_ring(g_buff, i);
+    fprintf(file, "mts_ipc_ring_fill_ratio{producer=\"%u\",consumer=\"%u\"} %.4f\n",
+	    ring->producer, ring->consumer,
+	    (double)ring_fill(ring) / ring->size);
+  }
+
+  metric_header(file, "mts_ipc_producer_respawns_total", "counter",
+		"Producers started again after exiting, or replaced when recycled.");
+  fprintf(file, "mts_ipc_producer_respawns_total{reason=\"exit\"} %lu\n",
+	  g_respawns);
+  fprintf(file, "mts_ipc_producer_respawns_total{reason=\"recycle\"} %lu\n",
+	  g_recycles);
+
+  metric_header(file, "mts_ipc_hung_producers_killed_total", "counter",
+		"Producers killed for missing their heartbeat.");
+  fprintf(file, "mts_ipc_hung_producers_killed_total %lu\n", g_hung_kills);
+
+  // Generation time, over all producers
+  uint64_t gen_hist[GEN_TIME_BUCKETS] = { 0 };
+  uint64_t gen_total = 0;
+  for(int i = 0; i < g_num_slots; i++) {
+    ring_t* lead = get_producer_ring(g_buff, i, 0);
+    for(int b = 0; b < GEN_TIME_BUCKETS; b++) {
+      gen_hist[b] += __atomic_load_n(&lead->gen_time_hist[b],
+				     __ATOMIC_RELAXED);
+    }
+    gen_total += __atomic_load_n(&lead->gen_time_total, __ATOMIC_RELAXED);
+  }
+  metric_header(file, "mts_ipc_generation_seconds", "histogram",
+		"Time producers took to generate a sample.");
+  metric_histogram(file, "mts_ipc_generation_seconds", "", gen_hist,
+		   GEN_TIME_BUCKETS, gen_total);
+
+  // p99 over the interval, as the upper bound of its bucket
+  uint64_t interval_count = 0;
+  for(int b = 0; b < GEN_TIME_BUCKETS; b++) {
+    interval_count += gen_hist[b] - g_metrics_gen_hist[b];
+  }
+  double p99 = NAN;
+  uint64_t seen = 0;
+  for(int b = 0; b < GEN_TIME_BUCKETS && interval_count > 0; b++) {
+    seen += gen_hist[b] - g_metrics_gen_hist[b];
+    if(seen >= 0.99 * interval_count) {
+      p99 = (double)((uint64_t)1 << b) / 1e6;
+      break;
+    }
+  }
+  memcpy(g_metrics_gen_hist, gen_hist, sizeof(gen_hist));
+  metric_header(file, "mts_ipc_generation_p99_seconds", "gauge",
+		"99th percentile of the generation time since the last snapshot (bucket upper bound).");
+  fprintf(file, "mts_ipc_generation_p99_seconds");
+  metric_value(file, p99);
 
-  // Reset local offsets
-  g_consume_offset = START_BUFF_OFFSET;
-  g_have_buff_lock = 0;
+  // Consumer side, from the statistics each consumer keeps in the buffer
+  // (whichever process consumes as it)
+  uint32_t num_consumers = get_num_consumers(g_buff);
+  metric_header(file, "mts_ipc_consumer_wait_seconds", "histogram",
+		"Time each consumer waited for each sample.");
+  for(uint32_t c = 0; c < num_consumers; c++) {
+    consumer_t* state = get_consumer(g_buff, c);
+    uint64_t wait_hist[CONSUMER_WAIT_BUCKETS];
+    for(int b = 0; b < CONSUMER_WAIT_BUCKETS; b++) {
+      wait_hist[b] = __atomic_load_n(&state->wait_hist[b], __ATOMIC_RELAXED);
+    }
+    char labels[32];
+    snprintf(labels, sizeof(labels), "consumer=\"%u\"", c);
+    metric_histogram(file, "mts_ipc_consumer_wait_seconds", labels,
+		     wait_hist, CONSUMER_WAIT_BUCKETS,
+		     __atomic_load_n(&state->wait_total, __ATOMIC_RELAXED));
+  }
+
+  metric_header(file, "mts_ipc_consumed_samples_total", "counter",
+		"Samples each consumer acquired.");
+  for(uint32_t c = 0; c < num_consumers; c++) {
+    fprintf(file, "mts_ipc_consumed_samples_total{consumer=\"%u\"} %lu\n", c,
+	    __atomic_load_n(&get_consumer(g_buff, c)->consumed,
+			    __ATOMIC_RELAXED));
+  }
+
+  metric_header(file, "mts_ipc_consumed_bytes_total", "counter",
+		"Bytes of the records each consumer acquired.");
+  for(uint32_t c = 0; c < num_consumers; c++) {
+    fprintf(file, "mts_ipc_consumed_bytes_total{consumer=\"%u\"} %lu\n", c,
+	    __atomic_load_n(&get_consumer(g_buff, c)->consumed_bytes,
+			    __ATOMIC_RELAXED));
+  }
+
+  metric_header(file, "mts_ipc_sample_bytes_avg", "gauge",
+		"Average record size each consumer acquired since the last snapshot.");
+  for(uint32_t c = 0; c < num_consumers; c++) {
+    consumer_t* state = get_consumer(g_buff, c);
+    uint64_t consumed = __atomic_load_n(&state->consumed, __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_load_n(&state->consumed_bytes, __ATOMIC_RELAXED);
+    uint64_t interval_consumed = consumed - g_metrics_consumed[c];
+    fprintf(file, "mts_ipc_sample_bytes_avg{consumer=\"%u\"}", c);
+    metric_value(file, interval_consumed > 0 ?
+		 (double)(bytes - g_metrics_consumed_bytes[c])
+		 / interval_consumed : NAN);
+    g_metrics_consumed[c] = consumed;
+    g_metrics_consumed_bytes[c] = bytes;
+  }
+
+  if(fclose(file) != 0 || rename(tmp_path, g_opts.metrics_path) != 0) {
+    perror(g_opts.metrics_path);
+  }
+}
+
+/* Write a metrics snapshot if one is due (only the process supervising the
+ * producers does) */
+void write_metrics(void) {
+  if(g_opts.metrics_path == NULL || g_slot_state == NULL) {
+    return;
+  }
+  uint64_t now = now_ns();
+  if(now - g_metrics_time < (uint64_t)g_opts.metrics_interval_ms * 1000000) {
+    return;
+  }
+
+  write_metrics_file((now - g_metrics_time) / 1e9);
+  g_metrics_time = now;
+}
+
+/* Exposed via mts_ipc.h -- for consumers driving ipc_* themselves */
+void* mts_ipc_get_buff(void) {
+  return g_buff;
+}
 
+int mts_ipc_get_fd(void) {
+  return g_shm_fd;
 }
 
-/* Get a sample from shared memory */
+void mts_ipc_supervise(void) {
+  check_producers();
+  write_metrics();
+}
+
+void mts_ipc_wait_histogram(uint64_t* counts, int reset) {
+  // The counts in the buffer only grow (the metrics read them too), so a
+  // reset moves this process's baseline instead
+  consumer_t* state = get_consumer(g_buff, g_consumer);
+  for(int b = 0; b < MTS_IPC_WAIT_BUCKETS; b++) {
+    uint64_t count = __atomic_load_n(&state->wait_hist[b], __ATOMIC_RELAXED);
+    counts[b] = count - g_wait_hist_base[b];
+    if(reset) {
+      g_wait_hist_base[b] = count;
+    }
+  }
+}
+
+/* Acquire a sample in shared memory */
+void mts_ipc_acquire_sample(sample_view_t* view) {
+  while(1) {
+    // Read the sequence number first so a sample published after the
+    // rings were checked will cut the sleep short
+    uint32_t seq = get_data_seq(g_buff, g_consumer);
+    if(ipc_acquire_sample(g_buff, g_consumer, &g_next_producer, view)) {
+      autoscale(view->ring);
+      check_producers();
+      write_metrics();
+      break;
+    }
+
+    // Sleep until a producer publishes something
+    uint64_t wait_start = now_ns();
+    wait_for_data(g_buff, g_consumer, seq, FUTEX_WAIT_TIMEOUT_MS);
+    g_waited += now_ns() - wait_start;
+
+    check_producers();
+    write_metrics();
+  }
+}
+
+/* Release a sample acquired from shared memory */
+void mts_ipc_release_sample(sample_view_t* view) {
+  ipc_release_sample(g_buff, view);
+}
+
+/* Get a copy of a sample from shared memory */
 void* mts_ipc_get_sample(void) {
-  sample_t* spl;
-  unsigned int attempts = 0;
-  time_t start_time = time(NULL);
-  int elapsed;
-  // Poll until you get a non-null sample
-  while(!(spl = (void*)ipc_get_sample(g_buff, &g_consume_offset,
-				      g_semid, &g_have_buff_lock))) {
-    /* tryin2consume */
-
-    /* Failsafe */
-    if(++attempts % 1000000 == 0) {
-      elapsed = time(NULL) - start_time;
-      if(elapsed >= ELAPSED_RESET_THRESHOLD) {
-	#ifdef TOLERATE_CONSUMER_FAILURE
-	mts_ipc_reset();
-	#else
-	fprintf("IPC consumption no longer functional. Too much failed polling time has elapsed. Exiting.\n");
+  sample_view_t view;
+  mts_ipc_acquire_sample(&view);
+
+  sample_t* spl = ipc_copy_sample(&view);
+  mts_ipc_release_sample(&view);
+
+  return spl;
+}
+
+/* Fill a batch with samples that fit it, skipping the ones that don't */
+int assemble_batch(int n, int height, int max_width,
+		   unsigned char* out_images,
+		   float* out_images_float, int* out_widths,
+		   char** out_labels) {
+  size_t slot_size = (size_t)height * max_width;
+  int skipped = 0;
+
+  // Zero padding
+  if(out_images != NULL) {
+    memset(out_images, 0, n*slot_size);
+  } else {
+    memset(out_images_float, 0, n*slot_size*sizeof(float));
+  }
+
+  for(int i = 0; i < n;) {
+    sample_view_t view;
+    mts_ipc_acquire_sample(&view);
+
+    if(ipc_copy_to_batch(&view, height, max_width,
+			 out_images ? out_images + i*slot_size : NULL,
+			 out_images ? NULL : out_images_float + i*slot_size)) {
+      out_widths[i] = (int)view.sample.width;
+      if(!(out_labels[i] = strdup(view.sample.caption))) {
+	perror("strdup");
 	exit(1);
-	#endif
-	start_time = time(NULL);
       }
+      i++;
+    } else {
+      skipped++;
     }
+
+    mts_ipc_release_sample(&view);
   }
 
-  return spl;
+  return skipped;
+}
+
+int mts_ipc_get_batch(int n, int height, int max_width,
+		      unsigned char* out_images, int* out_widths,
+		      char** out_labels) {
+  return assemble_batch(n, height, max_width, out_images, NULL,
+		   out_widths, out_labels);
+}
+
+int mts_ipc_get_batch_float(int n, int height, int max_width,
+			    float* out_images, int* out_widths,
+			    char** out_labels) {
+  return assemble_batch(n, height, max_width, NULL, out_images,
+		   out_widths, out_labels);
 }
 
-/* Currently unused -- retained for potential future use */
 void mts_ipc_cleanup(void) {
-  printf("cleanin up!\n");
+  if(g_buff == NULL) {
+    return;
+  }
+
+  // Only the process that started the producers stops them
+  if(g_slot_state != NULL) {
+    stop_producers();
+
+    free(g_producer_pids);
+    free(g_retiring_pids);
+    free((void*)g_recycle_requested);
+    free(g_slot_state);
+    free(g_spawned_at);
+    free(g_metrics_samples);
+    free(g_metrics_consumed);
+    free(g_metrics_consumed_bytes);
+    g_producer_pids = NULL;
+    g_retiring_pids = NULL;
+    g_recycle_requested = NULL;
+    g_slot_state = NULL;
+    g_spawned_at = NULL;
+    g_metrics_samples = NULL;
+    g_metrics_consumed = NULL;
+    g_metrics_consumed_bytes = NULL;
+    g_num_slots = 0;
+    g_num_active = 0;
+    free_opt_strings();
+  }
+
+  // Another process may attach as this consumer now
+  detach_consumer(g_buff, g_consumer);
+  memset(g_wait_hist_base, 0, sizeof(g_wait_hist_base));
+
+  release_shared_buff(g_buff);
+  close(g_shm_fd);
+  g_buff = NULL;
+  g_shm_fd = -1;
 }
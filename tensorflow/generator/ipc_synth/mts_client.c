@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "prod_cons.h"
+#include "mts_server.h"
+#include "mts_client.h"
+
+struct mts_client {
+  int fd;
+  uint32_t consumer;
+  void* buff;
+  uint64_t buff_size;
+  mts_sample_ref_t refs[MTS_SERVER_MAX_BATCH];
+};
+
+/* Send all len bytes of buf */
+static int send_all(int fd, const void* buf, size_t len) {
+  while(len > 0) {
+    ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+    if(sent <= 0) {
+      if(sent == -1 && errno == EINTR) {
+	continue;
+      }
+      return 0;
+    }
+    buf = (const char*)buf + sent;
+    len -= sent;
+  }
+  return 1;
+}
+
+/* Receive exactly len bytes into buf (0 on error or disconnect) */
+static int recv_all(int fd, void* buf, size_t len) {
+  while(len > 0) {
+    ssize_t got = recv(fd, buf, len, MSG_WAITALL);
+    if(got <= 0) {
+      if(got == -1 && errno == EINTR) {
+	continue;
+      }
+      return 0;
+    }
+    buf = (char*)buf + got;
+    len -= got;
+  }
+  return 1;
+}
+
+/* Send a message header */
+static int send_msg(mts_client_t* client, uint16_t type, uint32_t count) {
+  mts_msg_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.magic = MTS_SERVER_MAGIC;
+  msg.version = MTS_SERVER_VERSION;
+  msg.type = type;
+  msg.count = count;
+  return send_all(client->fd, &msg, sizeof(msg));
+}
+
+/* Receive the server's greeting and the shared buffer fd that comes with
+ * it (-1 if refused) */
+static int recv_hello(mts_client_t* client) {
+  mts_msg_t msg;
+  struct iovec iov;
+  iov.iov_base = &msg;
+  iov.iov_len = sizeof(msg);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = sizeof(control);
+
+  if(recvmsg(client->fd, &hdr, MSG_WAITALL | MSG_CMSG_CLOEXEC)
+     != sizeof(msg)) {
+    perror("mts_client: recvmsg");
+    return -1;
+  }
+  if(msg.magic != MTS_SERVER_MAGIC || msg.version != MTS_SERVER_VERSION) {
+    fprintf(stderr, "mts_client: server speaks another protocol\n");
+    return -1;
+  }
+  if(msg.type == MTS_MSG_REFUSED) {
+    fprintf(stderr, "mts_client: server has no consumer to spare\n");
+    return -1;
+  }
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+  if(msg.type != MTS_MSG_HELLO || cmsg == NULL
+     || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "mts_client: no shared buffer from server\n");
+    return -1;
+  }
+
+  int shm_fd;
+  memcpy(&shm_fd, CMSG_DATA(cmsg), sizeof(int));
+  client->consumer = msg.count;
+  return shm_fd;
+}
+
+/* Exposed via mts_client.h -- connect */
+mts_client_t* mts_client_connect(const char* socket_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "mts_client: socket path too long\n");
+    return NULL;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  mts_client_t* client = (mts_client_t*)calloc(1, sizeof(mts_client_t));
+  if(client == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(client->fd == -1
+     || connect(client->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    perror("mts_client: connect");
+    mts_client_close(client);
+    return NULL;
+  }
+
+  int shm_fd = recv_hello(client);
+  if(shm_fd == -1) {
+    mts_client_close(client);
+    return NULL;
+  }
+
+  // The mapping keeps the buffer alive, the fd isn't needed past this
+  struct stat st;
+  if(fstat(shm_fd, &st) == 0) {
+    client->buff_size = st.st_size;
+    client->buff = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			shm_fd, 0);
+  }
+  close(shm_fd);
+  if(client->buff == NULL || client->buff == MAP_FAILED) {
+    perror("mts_client: mmap");
+    client->buff = NULL;
+    mts_client_close(client);
+    return NULL;
+  }
+
+  return client;
+}
+
+/* Exposed via mts_client.h -- consumer index */
+int mts_client_consumer(mts_client_t* client) {
+  return (int)client->consumer;
+}
+
+/* Exposed via mts_client.h -- get batch */
+int mts_client_get_batch(mts_client_t* client, int n, sample_view_t* views) {
+  if(n < 0 || n > MTS_SERVER_MAX_BATCH
+     || !send_msg(client, MTS_MSG_GET, (uint32_t)n)) {
+    return 0;
+  }
+
+  mts_msg_t msg;
+  if(!recv_all(client->fd, &msg, sizeof(msg))
+     || msg.magic != MTS_SERVER_MAGIC || msg.type != MTS_MSG_BATCH
+     || msg.count != (uint32_t)n
+     || !recv_all(client->fd, client->refs, n*sizeof(mts_sample_ref_t))) {
+    fprintf(stderr, "mts_client: lost the server\n");
+    return 0;
+  }
+
+  for(int i = 0; i < n; i++) {
+    if(client->refs[i].offset + sizeof(record_header_t) > client->buff_size) {
+      fprintf(stderr, "mts_client: bad sample from server\n");
+      return 0;
+    }
+    record_header_t* rec =
+      (record_header_t*)((char*)client->buff + client->refs[i].offset);
+    if(rec->magic != RECORD_MAGIC || rec->version != RECORD_VERSION) {
+      fprintf(stderr, "mts_client: bad sample from server\n");
+      return 0;
+    }
+
+    views[i].sample.img_data = record_image(rec);
+    views[i].sample.height = rec->height;
+    views[i].sample.width = rec->width;
+    views[i].sample.caption = record_label(rec);
+    views[i].sample.bg_features = rec->bg_features;
+    views[i].sample.dropped_bg_features = rec->dropped_bg_features;
+    views[i].stride = rec->stride;
+    views[i].ring = client->refs[i].ring;
+    views[i].record = rec;
+  }
+
+  return 1;
+}
+
+/* Exposed via mts_client.h -- release */
+int mts_client_release(mts_client_t* client, int n,
+		       const sample_view_t* views) {
+  if(n < 0 || n > MTS_SERVER_MAX_BATCH) {
+    return 0;
+  }
+
+  for(int i = 0; i < n; i++) {
+    memset(&client->refs[i], 0, sizeof(mts_sample_ref_t));
+    client->refs[i].offset =
+      (uint64_t)((char*)views[i].record - (char*)client->buff);
+    client->refs[i].ring = views[i].ring;
+  }
+
+  return send_msg(client, MTS_MSG_RELEASE, (uint32_t)n)
+    && send_all(client->fd, client->refs, n*sizeof(mts_sample_ref_t));
+}
+
+/* Exposed via mts_client.h -- close */
+void mts_client_close(mts_client_t* client) {
+  if(client->buff != NULL) {
+    munmap(client->buff, client->buff_size);
+  }
+  if(client->fd != -1) {
+    close(client->fd);
+  }
+  free(client);
+}
@@ -0,0 +1,30 @@
+#ifndef MTS_CLIENT_H
+#define MTS_CLIENT_H
+
+#include "ipc_consumer.h"
+
+/* Client of mts_server, for consumers that don't start producers
+ * themselves. Samples are read from shared memory without copying. */
+
+typedef struct mts_client mts_client_t;
+
+// Connect to the server listening on socket_path.
+// Returns NULL on failure, or if the server has no consumer to spare
+mts_client_t* mts_client_connect(const char* socket_path);
+
+// Consumer index the server gave this client
+int mts_client_consumer(mts_client_t* client);
+
+// Fill views with the next n samples (at most MTS_SERVER_MAX_BATCH),
+// waiting until they are all there. The samples stay valid until released.
+// Returns 0 on failure
+int mts_client_get_batch(mts_client_t* client, int n, sample_view_t* views);
+
+// Let the producers reuse the space of n samples. Returns 0 on failure
+int mts_client_release(mts_client_t* client, int n,
+		       const sample_view_t* views);
+
+// Disconnect (samples still held are released by the server)
+void mts_client_close(mts_client_t* client);
+
+#endif
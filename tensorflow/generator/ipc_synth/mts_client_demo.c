@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mts_client.h"
+
+/* Monotonic time in s */
+double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Fetches batches from an mts_server, printing the first caption of each
+ * batch and the overall rate.
+ *
+ * Example usage :
+ * ./mts_server config.txt /tmp/mts.sock &
+ * ./mts_client_demo /tmp/mts.sock          (100 batches of 32)
+ * ./mts_client_demo /tmp/mts.sock 1000 64
+ */
+int main(int argc, char* argv[]) {
+  if(argc < 2 || argc > 4) {
+    fprintf(stderr, "usage: mts_client_demo socket_path [batches] [batch_size]\n");
+    exit(1);
+  }
+  int num_batches = argc > 2 ? atoi(argv[2]) : 100;
+  int batch_size = argc > 3 ? atoi(argv[3]) : 32;
+
+  mts_client_t* client = mts_client_connect(argv[1]);
+  if(client == NULL) {
+    exit(1);
+  }
+  printf("consumer %d\n", mts_client_consumer(client));
+
+  sample_view_t* views = (sample_view_t*)malloc(batch_size*sizeof(sample_view_t));
+  if(views == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  double start = now_s();
+  unsigned long pixels = 0;
+  for(int b = 0; b < num_batches; b++) {
+    if(!mts_client_get_batch(client, batch_size, views)) {
+      exit(1);
+    }
+
+    // Touch every sample, as a real consumer would
+    for(int i = 0; i < batch_size; i++) {
+      pixels += views[i].sample.height * views[i].sample.width;
+    }
+    printf("batch %d: \"%s\" (%zux%zu)\n", b, views[0].sample.caption,
+	   views[0].sample.width, views[0].sample.height);
+
+    if(!mts_client_release(client, batch_size, views)) {
+      exit(1);
+    }
+  }
+  double elapsed = now_s() - start;
+
+  printf("%d samples (%lu pixels) in %.2f s, %.1f samples/s\n",
+	 num_batches*batch_size, pixels, elapsed,
+	 num_batches*batch_size / elapsed);
+
+  free(views);
+  mts_client_close(client);
+  return 0;
+}
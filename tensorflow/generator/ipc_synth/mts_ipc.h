@@ -1,20 +1,149 @@
 #ifndef MTS_IPC_H
 #define MTS_IPC_H
 
-// Fix producer to cap its data to this value
-// Producer will die & respawn at this value
+#include "ipc_consumer.h"
+
+// Buckets of the wait histogram (see mts_ipc_wait_histogram)
+#define MTS_IPC_WAIT_BUCKETS 32
+
+// shm_node of the NUMA node the process calling mts_ipc_init_opts runs on
+#define MTS_IPC_LOCAL_NODE -2
+
+// Default cap on the data segment of producers (see data_limit_mb)
 #define PRODUCER_DATA_LIMIT (uint64_t)2*1073741824
 
-// Allow fault tolerance
-#define TOLERATE_CONSUMER_FAILURE
+typedef struct mts_ipc_opts {
+  int num_producers;        // producers started right away
+  const char* config_file;  // synthesizer config
+  uint64_t shm_size_mb;     // size of the shared buffer, split between rings
+  int huge_pages;           // back it with reserved huge pages (falls back
+                            // to normal pages if there aren't enough)
+  int zygote;               // fork producers from one warmed-up zygote
+                            // instead of exec'ing each of them
+  uint64_t seed;            // seed of the first producer, each next one gets
+                            // the following seed (0: based on time)
+  int num_consumers;        // processes sharing the producers, this one
+                            // being consumer 0 (see mts_ipc_attach)
+  const char* producer_path;  // producer binary, looked up in PATH if it
+                              // has no '/' (runs as "producer_path config
+                              // index seed" or "producer_path --zygote
+                              // config")
 
-#ifdef TOLERATE_CONSUMER_FAILURE
-// reset threshold in seconds
-#define ELAPSED_RESET_THRESHOLD 60
-#endif
+  /* Autoscaling -- off unless min_producers < max_producers. Every
+   * scale_window_ms one producer is added if the consumer spent more than
+   * scale_up_wait of the window waiting for samples, or parked (stopped,
+   * until it is needed again) if every sample came from an active ring that
+   * was at least scale_down_fill full. There is one ring per possible
+   * producer. Only the waits and rings of consumer 0 are measured. */
+  int min_producers;        // 0: num_producers
+  int max_producers;        // 0: num_producers
+  int scale_window_ms;
+  double scale_up_wait;     // fraction of the window
+  double scale_down_fill;   // fraction of the ring
+
+  /* Recycling -- a producer that has made recycle_samples samples, or
+   * whose RSS has reached recycle_rss_mb, finishes its current record and
+   * hands its ring over to a warm replacement before exiting (0: never) */
+  uint64_t recycle_samples;
+  uint64_t recycle_rss_mb;
+
+  // RLIMIT_DATA of producers, a producer hitting it crashes and is
+  // respawned. A safety net, as recycling catches growth well before; keep
+  // it until a long soak (samples/mts_soak_test 1000000 42) shows no
+  // growth past the warmup (0: no limit)
+  uint64_t data_limit_mb;
+
+  // A producer that neither publishes a record nor waits on its ring for
+  // this long is considered hung, and killed and respawned (0: never)
+  int heartbeat_timeout_ms;
+
+  /* Metrics -- every metrics_interval_ms a snapshot in Prometheus text
+   * format (e.g. for node_exporter's textfile collector) replaces the file
+   * at metrics_path: producer throughput, ring fill, respawns, generation
+   * time and this process' waits and sample sizes (NULL: off) */
+  const char* metrics_path;
+  int metrics_interval_ms;
+
+  /* Placement -- producers (and the zygote) run on the CPUs of
+   * producer_cpus, a list like "0-7,16-23" (NULL: those this process may
+   * run on), that are on NUMA node producer_node (-1: any) and not in
+   * reserved_cpus (e.g. those of the trainer's input threads). With
+   * pin_producers each producer is pinned to one of those CPUs, dealt
+   * round-robin, so it can't migrate across sockets. The pages of the shared
+   * buffer are all allocated up front on NUMA node shm_node (-1: wherever
+   * they are first touched, MTS_IPC_LOCAL_NODE: this process' node, which
+   * then should be pinned to it). */
+  const char* producer_cpus;
+  int producer_node;
+  const char* reserved_cpus;
+  int pin_producers;
+  int shm_node;
+} mts_ipc_opts_t;
 
+// Fill opts with defaults (1 producer, 1 consumer, 1 GB buffer without huge pages,
+// zygote on, time based seeds, autoscaling off, recycled at 1 GB RSS,
+// 2 GB data limit, 30 s heartbeat timeout, no metrics, producers and
+// buffer placed like this process)
+void mts_ipc_default_opts(mts_ipc_opts_t* opts);
+
+// Start the producers as opts say (its strings are copied, so they need
+// not outlive the call)
+void mts_ipc_init_opts(const mts_ipc_opts_t* opts);
 void mts_ipc_init(int num_producers, const char* config_file);
+
+/* Several consumers -- every producer deals its samples out round-robin
+ * over the consumers, each sample going to exactly one of them. A consumer
+ * that doesn't keep up is skipped while its rings are full rather than
+ * slowing the others down. */
+// Write the path other processes (of the same user) attach with to path,
+// returns its length like snprintf
+int mts_ipc_shared_path(char* path, size_t len);
+
+// Instead of mts_ipc_init(_opts), become consumer (1 .. num_consumers-1)
+// of the producers started by the process at path. Returns 0 on failure.
+int mts_ipc_attach(const char* path, int consumer);
+
+// The shared buffer and its fd, for consuming with the ipc_* functions of
+// ipc_consumer.h directly (e.g. from several threads, one per consumer).
+// mts_ipc_supervise must then be called about once a second, to replace
+// producers that died, retired or hung.
+void* mts_ipc_get_buff(void);
+int mts_ipc_get_fd(void);
+void mts_ipc_supervise(void);
+
+// Copy the histogram of the time this process's consumer waited for a
+// sample (in mts_ipc_acquire_sample and everything built on it, or in
+// wait_for_data for those driving ipc_* themselves) into
+// counts[MTS_IPC_WAIT_BUCKETS], then zero it if reset. counts[0] is the
+// number of samples that took less than 1 us to arrive (usually because
+// they were there right away), counts[k] the number that took
+// [2^(k-1), 2^k) us (the last bucket also counts anything longer).
+void mts_ipc_wait_histogram(uint64_t* counts, int reset);
+
+// Returns a heap allocated sample_t
 void* mts_ipc_get_sample(void);
+
+// Zero-copy access: view points into shared memory, and the sample's space
+// is only reused after it has been released
+void mts_ipc_acquire_sample(sample_view_t* view);
+void mts_ipc_release_sample(sample_view_t* view);
+
+// Fill a zero-padded [n, height, max_width, 1] batch (NHWC) with the next
+// n samples that fit in it, as uint8 or as floats scaled to [0,1].
+// out_widths gets the width of each sample, out_labels a heap allocated
+// copy of each label (to be freed by the caller).
+// Returns the number of samples skipped because they did not fit.
+int mts_ipc_get_batch(int n, int height, int max_width,
+		      unsigned char* out_images, int* out_widths,
+		      char** out_labels);
+int mts_ipc_get_batch_float(int n, int height, int max_width,
+			    float* out_images, int* out_widths,
+			    char** out_labels);
+
+// Stop and reap the producers and zygote (if this process started them),
+// restoring the SIGCHLD and SIGUSR1 handlers mts_ipc_init* replaced, then
+// give up the consumer and unmap the shared buffer. Samples acquired from
+// it must be released first.
 void mts_ipc_cleanup(void);
 
 
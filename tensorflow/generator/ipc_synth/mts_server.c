@@ -0,0 +1,434 @@
+#define _GNU_SOURCE  // POLLRDHUP
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "prod_cons.h"
+#include "ipc_consumer.h"
+#include "mts_ipc.h"
+#include "mts_server.h"
+
+/* Hosts a producer pool and serves its samples to clients connecting to a
+ * UNIX socket (see mts_server.h for the protocol). Every client is one
+ * consumer of the shared buffer, so each gets its own share of samples. */
+
+void* g_shared;
+int g_shared_fd;
+
+/* Consumers of the buffer, each handed to at most one client at a time */
+pthread_mutex_t g_consumers_lock = PTHREAD_MUTEX_INITIALIZER;
+int* g_consumer_taken;
+uint32_t g_num_consumers;
+
+volatile sig_atomic_t g_stop;
+
+typedef struct client {
+  int fd;
+  uint32_t consumer;
+  uint32_t next_producer;
+} client_t;
+
+/* Stop serving on SIGINT/SIGTERM */
+void stop_handler(int signo) {
+  (void)signo;
+  g_stop = 1;
+}
+
+/* Send all len bytes of buf */
+int send_all(int fd, const void* buf, size_t len) {
+  while(len > 0) {
+    ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+    if(sent <= 0) {
+      if(sent == -1 && errno == EINTR) {
+	continue;
+      }
+      return 0;
+    }
+    buf = (const char*)buf + sent;
+    len -= sent;
+  }
+  return 1;
+}
+
+/* Receive exactly len bytes into buf (0 on error or disconnect) */
+int recv_all(int fd, void* buf, size_t len) {
+  while(len > 0) {
+    ssize_t got = recv(fd, buf, len, MSG_WAITALL);
+    if(got <= 0) {
+      if(got == -1 && errno == EINTR) {
+	continue;
+      }
+      return 0;
+    }
+    buf = (char*)buf + got;
+    len -= got;
+  }
+  return 1;
+}
+
+/* Fill in a message header */
+void init_msg(mts_msg_t* msg, uint16_t type, uint32_t count) {
+  memset(msg, 0, sizeof(*msg));
+  msg->magic = MTS_SERVER_MAGIC;
+  msg->version = MTS_SERVER_VERSION;
+  msg->type = type;
+  msg->count = count;
+}
+
+/* Greet a client, passing it the shared buffer */
+int send_hello(int fd, uint32_t consumer) {
+  mts_msg_t msg;
+  init_msg(&msg, MTS_MSG_HELLO, consumer);
+
+  struct iovec iov;
+  iov.iov_base = &msg;
+  iov.iov_len = sizeof(msg);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = sizeof(control);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &g_shared_fd, sizeof(int));
+
+  return sendmsg(fd, &hdr, MSG_NOSIGNAL) == sizeof(msg);
+}
+
+/* Whether the client has closed its end of the socket */
+int hung_up(int fd) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLRDHUP;
+  return poll(&pfd, 1, 0) == 1
+    && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+/* Acquire n samples for client, waiting for producers as needed.
+ * Returns 0 if the client went away in the meantime */
+int acquire_batch(client_t* client, uint32_t n, mts_sample_ref_t* refs) {
+  for(uint32_t i = 0; i < n;) {
+    // Read the sequence number first so a sample published after the
+    // rings were checked will cut the sleep short
+    uint32_t seq = get_data_seq(g_shared, client->consumer);
+
+    sample_view_t view;
+    if(ipc_acquire_sample(g_shared, client->consumer, &client->next_producer,
+			  &view)) {
+      memset(&refs[i], 0, sizeof(refs[i]));
+      refs[i].offset = (uint64_t)((char*)view.record - (char*)g_shared);
+      refs[i].ring = view.ring;
+      i++;
+      continue;
+    }
+
+    wait_for_data(g_shared, client->consumer, seq, FUTEX_WAIT_TIMEOUT_MS);
+    if(hung_up(client->fd)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Release a sample the client is done with, after checking that the
+ * client really holds it. Returns 0 for a bad ref */
+int release_ref(client_t* client, const mts_sample_ref_t* ref) {
+  if(ref->ring >= get_num_rings(g_shared)) {
+    return 0;
+  }
+  ring_t* ring = get_ring(g_shared, ref->ring);
+  if(ring->consumer != client->consumer) {
+    return 0;
+  }
+
+  // Must be a record between the tail and the read counter of the ring
+  uint64_t data = ring->offset + sizeof(ring_t);
+  if(ref->offset < data || ref->offset >= data + ring->size) {
+    return 0;
+  }
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  uint64_t read = __atomic_load_n(&ring->read, __ATOMIC_RELAXED);
+  uint64_t pos = ref->offset - data;
+  if((pos + ring->size - tail % ring->size) % ring->size >= read - tail) {
+    return 0;
+  }
+  record_header_t* rec = (record_header_t*)((char*)g_shared + ref->offset);
+  if(rec->magic != RECORD_MAGIC) {
+    return 0;
+  }
+
+  sample_view_t view;
+  view.ring = ref->ring;
+  view.record = rec;
+  ipc_release_sample(g_shared, &view);
+  return 1;
+}
+
+/* Serve one client until it disconnects */
+void* serve_client(void* arg) {
+  client_t* client = (client_t*)arg;
+  mts_sample_ref_t* refs =
+    (mts_sample_ref_t*)malloc(MTS_SERVER_MAX_BATCH*sizeof(mts_sample_ref_t));
+  if(refs == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  mts_msg_t msg;
+  int ok = send_hello(client->fd, client->consumer);
+  while(ok && recv_all(client->fd, &msg, sizeof(msg))) {
+    if(msg.magic != MTS_SERVER_MAGIC || msg.version != MTS_SERVER_VERSION
+       || msg.count > MTS_SERVER_MAX_BATCH) {
+      fprintf(stderr, "mts_server: bad message from consumer %u\n",
+	      client->consumer);
+      break;
+    }
+
+    if(msg.type == MTS_MSG_GET) {
+      ok = acquire_batch(client, msg.count, refs);
+      init_msg(&msg, MTS_MSG_BATCH, msg.count);
+      ok = ok && send_all(client->fd, &msg, sizeof(msg))
+	&& send_all(client->fd, refs, msg.count*sizeof(mts_sample_ref_t));
+    } else if(msg.type == MTS_MSG_RELEASE) {
+      ok = recv_all(client->fd, refs, msg.count*sizeof(mts_sample_ref_t));
+      for(uint32_t i = 0; ok && i < msg.count; i++) {
+	if(!release_ref(client, &refs[i])) {
+	  fprintf(stderr, "mts_server: bad release from consumer %u\n",
+		  client->consumer);
+	  ok = 0;
+	}
+      }
+    } else {
+      fprintf(stderr, "mts_server: unknown message type %u\n", msg.type);
+      ok = 0;
+    }
+  }
+
+  // Whatever the client still held goes back to the producers
+  ipc_drop_held_samples(g_shared, client->consumer);
+
+  pthread_mutex_lock(&g_consumers_lock);
+  g_consumer_taken[client->consumer] = 0;
+  pthread_mutex_unlock(&g_consumers_lock);
+
+  close(client->fd);
+  free(refs);
+  free(client);
+  return NULL;
+}
+
+/* Give a new client a free consumer and a thread of its own */
+void accept_client(int listen_fd) {
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if(fd == -1) {
+    return;
+  }
+
+  int consumer = -1;
+  pthread_mutex_lock(&g_consumers_lock);
+  for(uint32_t i = 0; i < g_num_consumers; i++) {
+    if(!g_consumer_taken[i]) {
+      g_consumer_taken[i] = 1;
+      consumer = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_consumers_lock);
+
+  if(consumer == -1) {
+    mts_msg_t msg;
+    init_msg(&msg, MTS_MSG_REFUSED, 0);
+    send_all(fd, &msg, sizeof(msg));
+    close(fd);
+    return;
+  }
+
+  client_t* client = (client_t*)calloc(1, sizeof(client_t));
+  if(client == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  client->fd = fd;
+  client->consumer = consumer;
+
+  // Producers are only respawned from the main thread, so client threads
+  // start with the spawn signals blocked
+  sigset_t spawn_signals, old;
+  sigemptyset(&spawn_signals);
+  sigaddset(&spawn_signals, SIGCHLD);
+  sigaddset(&spawn_signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &spawn_signals, &old);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if(pthread_create(&thread, &attr, &serve_client, client)) {
+    perror("pthread_create");
+    exit(1);
+  }
+  pthread_attr_destroy(&attr);
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Listen on socket_path with permissions mode, refusing to take it over
+ * from a live server */
+int listen_on(const char* socket_path, mode_t mode) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "mts_server: socket path too long\n");
+    exit(1);
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd == -1) {
+    perror("socket");
+    exit(1);
+  }
+
+  // A stale socket of a server that is gone can be replaced
+  if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "mts_server: a server is already listening on %s\n",
+	    socket_path);
+    exit(1);
+  }
+  unlink(socket_path);
+
+  // Whoever can connect gets the samples and a mapping of the shared
+  // buffer, so the socket is created with no more than mode to begin with
+  mode_t old_umask = umask(~mode & 0777);
+  int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+  umask(old_umask);
+  if(bound == -1) {
+    perror("bind");
+    exit(1);
+  }
+  if(chmod(socket_path, mode) == -1) {
+    perror("chmod");
+    exit(1);
+  }
+  if(listen(fd, 16) == -1) {
+    perror("listen");
+    exit(1);
+  }
+  return fd;
+}
+
+void usage(void) {
+  fprintf(stderr,
+	  "usage: mts_server [-p producers] [-c max_clients] [-m shm_size_mb]\n"
+	  "                  [-H] [-s seed] [-M metrics_file] [-C cpus]\n"
+	  "                  [-R reserved_cpus] [-N numa_node] [-P]\n"
+	  "                  [-S socket_mode]\n"
+	  "                  \"/path/to/config_file\" socket_path\n"
+	  "  -H  back the shared buffer with huge pages\n"
+	  "  -M  write Prometheus metrics to metrics_file every 10 s\n"
+	  "  -C  run producers on these CPUs only (e.g. 0-7,16-23)\n"
+	  "  -R  keep producers off these CPUs\n"
+	  "  -N  run producers and allocate the shared buffer on this node\n"
+	  "  -P  pin each producer to a CPU of its own\n"
+	  "  -S  permissions of the socket, in octal (default 600: this user)\n");
+  exit(1);
+}
+
+/*
+ * Example usage :
+ * ./mts_server -p 8 -c 4 config.txt /tmp/mts.sock
+ * ./mts_server -p 8 -c 4 -N 1 -R 24-27 -P config.txt /tmp/mts.sock
+ */
+int main(int argc, char* argv[]) {
+  mts_ipc_opts_t opts;
+  mts_ipc_default_opts(&opts);
+  opts.num_consumers = 1;
+  mode_t socket_mode = 0600;
+
+  int opt;
+  while((opt = getopt(argc, argv, "p:c:m:Hs:M:C:R:N:PS:")) != -1) {
+    switch(opt) {
+    case 'p': opts.num_producers = atoi(optarg); break;
+    case 'c': opts.num_consumers = atoi(optarg); break;
+    case 'm': opts.shm_size_mb = strtoull(optarg, NULL, 10); break;
+    case 'H': opts.huge_pages = 1; break;
+    case 's': opts.seed = strtoull(optarg, NULL, 10); break;
+    case 'M': opts.metrics_path = optarg; break;
+    case 'C': opts.producer_cpus = optarg; break;
+    case 'R': opts.reserved_cpus = optarg; break;
+    case 'N': opts.producer_node = opts.shm_node = atoi(optarg); break;
+    case 'P': opts.pin_producers = 1; break;
+    case 'S': socket_mode = (mode_t)strtoul(optarg, NULL, 8) & 0777; break;
+    default: usage();
+    }
+  }
+  if(argc - optind != 2 || opts.num_producers < 1 || opts.num_consumers < 1) {
+    usage();
+  }
+  opts.config_file = argv[optind];
+  const char* socket_path = argv[optind + 1];
+
+  int listen_fd = listen_on(socket_path, socket_mode);
+
+  mts_ipc_init_opts(&opts);
+  g_shared = mts_ipc_get_buff();
+  g_shared_fd = mts_ipc_get_fd();
+  g_num_consumers = get_num_consumers(g_shared);
+  g_consumer_taken = (int*)calloc(g_num_consumers, sizeof(int));
+  if(g_consumer_taken == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+
+  // This process consumes on behalf of every client
+  for(uint32_t i = 1; i < g_num_consumers; i++) {
+    attach_consumer(g_shared, i);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = &stop_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  printf("mts_server: %d producers, up to %u clients on %s\n",
+	 opts.num_producers, g_num_consumers, socket_path);
+  fflush(stdout);
+
+  while(!g_stop) {
+    struct pollfd pfd;
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    int ready = poll(&pfd, 1, FUTEX_WAIT_TIMEOUT_MS);
+
+    mts_ipc_supervise();
+    if(ready == 1) {
+      accept_client(listen_fd);
+    }
+  }
+
+  // Producers follow once this process is gone (PR_SET_PDEATHSIG)
+  close(listen_fd);
+  unlink(socket_path);
+  return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef MTS_SERVER_H
+#define MTS_SERVER_H
+
+#include <stdint.h>
+
+/*
+ * Protocol between mts_server and its clients, over a UNIX stream socket.
+ *
+ * Every message is an mts_msg_t, followed by count mts_sample_ref_t for
+ * BATCH and RELEASE messages:
+ *
+ *   server -> client  HELLO    once, on connect. Carries the fd of the
+ *                              shared buffer (SCM_RIGHTS), count is the
+ *                              client's consumer index
+ *   server -> client  REFUSED  instead of HELLO if every consumer is taken
+ *   client -> server  GET      ask for a batch of count samples
+ *   server -> client  BATCH    the batch, as count sample refs
+ *   client -> server  RELEASE  give count samples back
+ *
+ * Samples are read straight from the client's mapping of the shared
+ * buffer, where they stay until released. A client that disconnects
+ * releases everything it holds.
+ */
+
+// Magic num at the start of every message ("MTSV")
+#define MTS_SERVER_MAGIC ((uint32_t)0x5653544d)
+
+// Version of the protocol
+#define MTS_SERVER_VERSION 1
+
+// Most samples a client may ask for in one GET
+#define MTS_SERVER_MAX_BATCH 4096
+
+// Message types
+#define MTS_MSG_HELLO 1
+#define MTS_MSG_REFUSED 2
+#define MTS_MSG_GET 3
+#define MTS_MSG_BATCH 4
+#define MTS_MSG_RELEASE 5
+
+typedef struct mts_msg {
+  uint32_t magic;    // MTS_SERVER_MAGIC
+  uint16_t version;  // MTS_SERVER_VERSION
+  uint16_t type;     // MTS_MSG_*
+  uint32_t count;
+  uint32_t pad;
+} mts_msg_t;
+
+// A sample in the shared buffer
+typedef struct mts_sample_ref {
+  uint64_t offset;  // of its record_header_t, from the start of the buffer
+  uint32_t ring;    // ring the record is in
+  uint32_t pad;
+} mts_sample_ref_t;
+
+#endif
@@ -1,125 +1,600 @@
-#include <sys/ipc.h>
-#include <sys/shm.h>
-#include <sys/sem.h>
+#define _GNU_SOURCE  // memfd_create
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
 
 #include "prod_cons.h"
 
-union semun {
-  int val;
-  struct semid_ds *buf;
-  ushort *array;
-};
-
-/* Determine key, given character */
-void set_key(key_t* key, char uniq) {
-  /* make key */
-  /* Note: get inode + character to hopefully get unique key */
-  char* filename = getenv("MTS_IPC");
-  if(filename == NULL) {
-    fprintf(stderr,"Missing MTS_IPC environmental variable.\n");
+int create_shared_fd(uint64_t size, int huge_pages) {
+  // Name is only for /proc/<pid>/fd and /proc/<pid>/maps, memfds don't
+  // share a namespace, so pipelines on the same host can't collide
+  char name[32];
+  snprintf(name, sizeof(name), "mts_ipc.%d", (int)getpid());
+
+  int fd = -1;
+  if(huge_pages) {
+    uint64_t huge_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE
+      * HUGE_PAGE_SIZE;
+    fd = memfd_create(name, MFD_CLOEXEC | MFD_HUGETLB);
+    if(fd != -1 && ftruncate(fd, huge_size) == -1) {
+      close(fd);
+      fd = -1;
+    }
+
+    // Huge pages are only reserved once mapped, so check that they can be
+    void* probe;
+    if(fd != -1 && (probe = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      close(fd);
+      fd = -1;
+    } else if(fd != -1) {
+      munmap(probe, huge_size);
+    }
+    if(fd == -1) {
+      perror("memfd_create MFD_HUGETLB (are enough huge pages reserved in vm.nr_hugepages?)");
+      fprintf(stderr, "Falling back to normal pages.\n");
+    }
+  }
+
+  // No need to clear it, as only headers are read and it starts out zeroed
+  if(fd == -1) {
+    if((fd = memfd_create(name, MFD_CLOEXEC)) == -1) {
+      perror("memfd_create");
+      exit(1);
+    }
+    if(ftruncate(fd, size) == -1) {
+      perror("ftruncate");
+      exit(1);
+    }
+  }
+
+  return fd;
+}
+
+uint64_t shared_fd_size(int fd) {
+  struct stat st;
+  if(fstat(fd, &st) == -1) {
+    perror("fstat");
     exit(1);
   }
-  if((*key = ftok(filename, uniq)) == -1) {
-    perror("ftok");
+  return st.st_size;
+}
+
+void* map_shared_buff(int fd) {
+  uint64_t size = shared_fd_size(fd);
+  void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(data == MAP_FAILED) {
+    perror("mmap");
     exit(1);
   }
+
+  // Ask for transparent huge pages where huge pages weren't reserved
+  // (fails harmlessly if the buffer already is huge page backed)
+  madvise(data, size, MADV_HUGEPAGE);
+
+  return data;
 }
 
-int get_shmid(int create) {
-  key_t key;
-  int shmid;
+int bind_shared_buff(int fd, void* buff, int node) {
+  struct stat st;
+  unsigned long nodemask[MAX_NUMA_NODES / (8*sizeof(unsigned long))];
+  if(node < 0 || node >= MAX_NUMA_NODES || fstat(fd, &st) == -1) {
+    return 0;
+  }
+  memset(nodemask, 0, sizeof(nodemask));
+  nodemask[node / (8*sizeof(unsigned long))] |=
+    1UL << (node % (8*sizeof(unsigned long)));
+
+  // Raw syscall, so there's no need for libnuma (maxnode counts one past
+  // the last bit, see mbind(2))
+  if(syscall(SYS_mbind, buff, (unsigned long)st.st_size, MPOL_BIND, nodemask,
+	     (unsigned long)MAX_NUMA_NODES + 1, MPOL_MF_MOVE) == -1) {
+    perror("mbind");
+    return 0;
+  }
+
+  // Fault every page in now: a memfd keeps the policy for other mappings,
+  // but huge pages only honour the policy of the mapping they are
+  // faulted through. The buffer is all zeros, so writing zeros is harmless.
+  for(off_t i = 0; i < st.st_size; i += st.st_blksize) {
+    ((volatile char*)buff)[i] = 0;
+  }
+  return 1;
+}
 
-  /* Get key */
-  set_key(&key, 'B');
-  
-  /* get or create shared memory segment */
-  int shmflags = create ? (0666 | IPC_CREAT) : 0666;
-  
-  if((shmid = shmget(key, SHM_SIZE, shmflags)) == -1) {
-    perror("shmget");
+void pass_shared_fd(int fd) {
+  // Keep the fd open across exec
+  if(fcntl(fd, F_SETFD, 0) == -1) {
+    perror("fcntl");
     exit(1);
   }
-  return shmid;
+
+  char fd_arg[16];
+  snprintf(fd_arg, sizeof(fd_arg), "%d", fd);
+  setenv(SHM_FD_ENV, fd_arg, 1);
+}
+
+void* get_shared_buff(void) {
+  char* fd_arg = getenv(SHM_FD_ENV);
+  if(fd_arg == NULL) {
+    fprintf(stderr, "Missing %s environmental variable (producers are started by the consumer).\n", SHM_FD_ENV);
+    exit(1);
+  }
+  return map_shared_buff(atoi(fd_arg));
+}
+
+void release_shared_buff(void* buff) {
+  // shm_size is the size mapped (see mts_ipc_init_opts), so this also
+  // works for huge pages, which can only be unmapped whole
+  munmap(buff, ((shm_header_t*)buff)->shm_size);
+}
+
+int time_bucket(uint64_t ns, int num_buckets) {
+  int bucket = 0;
+  for(uint64_t us = ns / 1000; us > 0 && bucket < num_buckets - 1; us >>= 1) {
+    bucket++;
+  }
+  return bucket;
+}
+
+uint64_t record_size(uint32_t label_len, uint32_t stride, uint32_t height) {
+  return RECORD_ALIGN(sizeof(record_header_t) + label_len + 1)
+    + RECORD_ALIGN((uint64_t)stride * height);
+}
+
+char* record_label(record_header_t* rec) {
+  return (char*)rec + sizeof(record_header_t);
+}
+
+unsigned char* record_image(record_header_t* rec) {
+  return (unsigned char*)rec
+    + RECORD_ALIGN(sizeof(record_header_t) + rec->label_len + 1);
 }
 
-void* get_shared_buff(int create) {
-  char* data;
+/* FNV-1a over label and image */
+uint32_t record_checksum(record_header_t* rec) {
+  uint32_t hash = 2166136261u;
+
+  unsigned char* label = (unsigned char*)record_label(rec);
+  for(uint32_t i = 0; i < rec->label_len; i++) {
+    hash = (hash ^ label[i]) * 16777619u;
+  }
+
+  unsigned char* image = record_image(rec);
+  for(uint64_t i = 0; i < (uint64_t)rec->stride * rec->height; i++) {
+    hash = (hash ^ image[i]) * 16777619u;
+  }
 
-  int shmid = get_shmid(create);
+  return hash;
+}
 
-  /* attach to the segment to get a ptr */
-  data = shmat(shmid, (void*)0, 0);
-  if(data == (char*)(-1)) {
-    perror("shmat");
+/* Split the buffer evenly, keeping every ring control block cache aligned */
+void init_rings(void* buff, uint32_t num_producers, uint32_t num_consumers,
+		uint64_t size) {
+  shm_header_t* header = (shm_header_t*)buff;
+
+  uint32_t num_rings = num_producers * num_consumers;
+  uint64_t rings_start = sizeof(shm_header_t)
+    + num_consumers*sizeof(consumer_t);
+  uint64_t per_ring = size > rings_start ? (size - rings_start) / num_rings : 0;
+  if(per_ring <= sizeof(ring_t)) {
+    fprintf(stderr, "Shared buffer of %lu bytes is too small for %u rings.\n",
+	    size, num_rings);
     exit(1);
   }
+  uint64_t ring_size = per_ring - sizeof(ring_t);
+  ring_size -= ring_size % CACHE_LINE_SIZE;
 
-  return data;
+  header->shm_size = size;
+  header->num_rings = num_rings;
+  header->num_consumers = num_consumers;
+  header->ring_size = ring_size;
+  header->recycle_samples = 0;
+  header->recycle_rss = 0;
+
+  for(uint32_t i = 0; i < num_consumers; i++) {
+    consumer_t* consumer = get_consumer(buff, i);
+    consumer->data_seq = 0;
+    consumer->consumer_waiting = 0;
+    consumer->pid = 0;
+    consumer->consumed = 0;
+    consumer->consumed_bytes = 0;
+    consumer->wait_pending = 0;
+    consumer->wait_total = 0;
+    memset(consumer->wait_hist, 0, sizeof(consumer->wait_hist));
+  }
+
+  for(uint32_t i = 0; i < num_rings; i++) {
+    ring_t* ring = get_ring(buff, i);
+    ring->size = ring_size;
+    ring->index = i;
+    ring->offset = (intptr_t)ring - (intptr_t)buff;
+    ring->producer = i / num_consumers;
+    ring->consumer = i % num_consumers;
+    ring->head = 0;
+    ring->next_seq = 0;
+    ring->heartbeat = 0;
+    ring->owner_pid = 0;
+    ring->handoff = 0;
+    ring->next_consumer = 0;
+    ring->tail = 0;
+    ring->read = 0;
+    ring->read_seq = 0;
+    ring->tail_seq = 0;
+    ring->producer_waiting = 0;
+    ring->parked = 0;
+    memset(ring->gen_time_hist, 0, sizeof(ring->gen_time_hist));
+    ring->gen_time_total = 0;
+  }
 }
 
-/* Really get semid for semaphores */
-int get_semaphores(int create) {
-  key_t key;
-  struct semid_ds buf;
-  struct sembuf sb;
-  int semid;
-  
-  /* Get key */
-  set_key(&key, 'B');
-
-  int semflags = create ? 0666 | IPC_CREAT : 0666;
-  semid = semget(key, 1, semflags);
-
-  if(create) {
-    sb.sem_num = 0;
-    sb.sem_op = 1;
-    sb.sem_flg = 0;
-    union semun arg;
-    arg.val = 1;
-    if(semctl(semid, 0, SETVAL, arg) == -1) {
-      perror("semctl: semaphore initialization");
-      exit(1);
+uint32_t get_num_rings(void* buff) {
+  return (uint32_t)((shm_header_t*)buff)->num_rings;
+}
+
+uint32_t get_num_consumers(void* buff) {
+  return (uint32_t)((shm_header_t*)buff)->num_consumers;
+}
+
+uint32_t get_num_producers(void* buff) {
+  return get_num_rings(buff) / get_num_consumers(buff);
+}
+
+consumer_t* get_consumer(void* buff, uint32_t consumer) {
+  return (consumer_t*)((intptr_t)buff + sizeof(shm_header_t))
+    + consumer;
+}
+
+ring_t* get_ring(void* buff, uint32_t index) {
+  shm_header_t* header = (shm_header_t*)buff;
+  uint64_t stride = sizeof(ring_t) + header->ring_size;
+  return (ring_t*)((intptr_t)buff + sizeof(shm_header_t)
+		   + header->num_consumers*sizeof(consumer_t) + index*stride);
+}
+
+ring_t* get_producer_ring(void* buff, uint32_t producer, uint32_t consumer) {
+  return get_ring(buff, producer*get_num_consumers(buff) + consumer);
+}
+
+/* Record data of a ring starts right after its control block */
+static unsigned char* ring_data(ring_t* ring) {
+  return (unsigned char*)ring + sizeof(ring_t);
+}
+
+/* Find the buffer header from one of its rings */
+static shm_header_t* ring_header(ring_t* ring) {
+  return (shm_header_t*)((intptr_t)ring - ring->offset);
+}
+
+ring_t* ring_lead(ring_t* ring) {
+  return get_producer_ring(ring_header(ring), ring->producer, 0);
+}
+
+/* CLOCK_MONOTONIC in ns (the same clock in every process) */
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Sleep while *addr == val (shared between processes, so not private) */
+static void futex_wait(uint32_t* addr, uint32_t val, int timeout_ms) {
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &timeout, NULL, 0);
+}
+
+/* Wake up to num processes sleeping on addr */
+static void futex_wake(uint32_t* addr, int num) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, num, NULL, NULL, 0);
+}
+
+/* Whether at least len bytes of the ring are free */
+static int ring_has_space(ring_t* ring, uint64_t head, uint64_t len) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  return ring->size - (head - tail) >= len;
+}
+
+/* Whether a record of len bytes can be reserved in the ring right away,
+ * counting the bytes skipped if it has to wrap */
+static int ring_can_reserve(ring_t* ring, uint64_t len) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  uint64_t pos = head % ring->size;
+  if(pos + len > ring->size) {
+    len += ring->size - pos;
+  }
+  return ring_has_space(ring, head, len);
+}
+
+/* Sleep on the lead ring until a consumer of the producer releases
+ * something, unless ready (checked again once the consumers know to wake
+ * the producer up) */
+static void ring_wait_for_release(ring_t* lead, int (*ready)(void*),
+				  void* arg) {
+  while(!ready(arg)) {
+    uint32_t seq = __atomic_load_n(&lead->tail_seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&lead->producer_waiting, 1, __ATOMIC_SEQ_CST);
+
+    if(ready(arg)) {
+      break;
     }
+    futex_wait(&lead->tail_seq, seq, FUTEX_WAIT_TIMEOUT_MS);
+    ring_beat(lead);
   }
+  __atomic_store_n(&lead->producer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+/* What ring_wait_for_release waits for */
+typedef struct space_wait {
+  ring_t* ring;
+  uint64_t head;
+  uint64_t len;
+  ring_t* found;  // ring_select only
+} space_wait_t;
+
+static int space_ready(void* arg) {
+  space_wait_t* wait = (space_wait_t*)arg;
+  return ring_has_space(wait->ring, wait->head, wait->len);
+}
 
-  return semid;
+/* Sleep until at least len bytes of the ring are free */
+static void ring_wait_for_space(ring_t* ring, uint64_t head, uint64_t len) {
+  space_wait_t wait = { ring, head, len, NULL };
+  ring_wait_for_release(ring_lead(ring), &space_ready, &wait);
 }
 
-/* Abstract away some semaphore details to lock */
-void lock_buff(int semid) {
-  struct sembuf sop;
-  
-  // index of desired sem
-  sop.sem_num = 0;
+/* Find the first ring of the producer, going round-robin from the next
+ * consumer, that has room for the record */
+static int select_ready(void* arg) {
+  space_wait_t* wait = (space_wait_t*)arg;
+  ring_t* lead = wait->ring;
+  void* buff = ring_header(lead);
+  uint32_t num_consumers = get_num_consumers(buff);
 
-  // op of desired sem (in this case, wait until 1 'resource' is available
-  sop.sem_op = -1;
+  for(uint32_t i = 0; i < num_consumers; i++) {
+    uint32_t consumer = (lead->next_consumer + i) % num_consumers;
+    ring_t* ring = get_producer_ring(buff, lead->producer, consumer);
+    if(ring_can_reserve(ring, wait->len)) {
+      wait->found = ring;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+ring_t* ring_select(ring_t* lead, uint64_t len) {
+  if(len > lead->size) {
+    return NULL;
+  }
 
-  // flag to ensure semaphore gets reset in the case of unclean exit
-  sop.sem_flg = SEM_UNDO;
+  // Consumers with room are dealt records in turn; one without room (no
+  // credit left) is skipped until it catches up, so it can't hold up the
+  // others
+  space_wait_t wait = { lead, 0, len, NULL };
+  ring_wait_for_release(lead, &select_ready, &wait);
 
-  // apply sop to semaphore `semid`
-  semop(semid, &sop, 1); 
+  lead->next_consumer = (wait.found->consumer + 1)
+    % get_num_consumers(ring_header(lead));
+  return wait.found;
 }
 
-/* Abstract away some semaphore detail to unlock */
-void unlock_buff(int semid) {
-  struct sembuf sop;
-  
-  // index of desired sem
-  sop.sem_num = 0;
+void* ring_reserve(ring_t* ring, uint64_t len) {
+  if(len > ring->size) {
+    return NULL;
+  }
+
+  // Only this producer writes head, so a relaxed load is enough
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  uint64_t pos = head % ring->size;
 
-  // op of desired sem (in this case, release 1 'resource')
-  sop.sem_op = 1;
+  // Record does not fit before the end of the ring, so tell the consumer
+  // to wrap and start over at the beginning
+  if(pos + len > ring->size) {
+    uint64_t skip = ring->size - pos;
+    ring_wait_for_space(ring, head, skip);
+    *(uint64_t*)(ring_data(ring) + pos) = NO_SPACE_TO_PRODUCE;
+    head += skip;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    pos = 0;
+  }
+
+  ring_wait_for_space(ring, head, len);
+  return ring_data(ring) + pos;
+}
 
-  // flag to ensure semaphore gets reset in the case of unclean exit
-  sop.sem_flg = SEM_UNDO;
+void ring_commit(ring_t* ring, uint64_t len) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+  // Release so the record contents are visible before the new head
+  __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+  ring_beat(ring_lead(ring));
+
+  // Let the consumer know, waking it up if it is sleeping
+  consumer_t* consumer = get_consumer(ring_header(ring), ring->consumer);
+  __atomic_add_fetch(&consumer->data_seq, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&consumer->consumer_waiting, __ATOMIC_SEQ_CST)) {
+    futex_wake(&consumer->data_seq, 1);
+  }
+}
+
+void ring_wait_while_parked(ring_t* lead) {
+  uint32_t parked;
+  while((parked = __atomic_load_n(&lead->parked, __ATOMIC_ACQUIRE))) {
+    futex_wait(&lead->parked, parked, FUTEX_WAIT_TIMEOUT_MS);
+    ring_beat(lead);
+  }
+}
+
+void ring_hand_off(ring_t* lead, int supervisor, int timeout_ms) {
+  // Release so everything this producer wrote is visible to its replacement
+  __atomic_store_n(&lead->handoff, 1, __ATOMIC_RELEASE);
+  kill(supervisor, SIGUSR1);
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while(__atomic_load_n(&lead->handoff, __ATOMIC_ACQUIRE)) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int elapsed_ms = (now.tv_sec - start.tv_sec) * 1000
+      + (now.tv_nsec - start.tv_nsec) / 1000000;
+    if(elapsed_ms >= timeout_ms) {
+      return;
+    }
+    futex_wait(&lead->handoff, 1, timeout_ms - elapsed_ms);
+  }
+}
+
+void ring_take_over(ring_t* lead) {
+  __atomic_store_n(&lead->owner_pid, (uint32_t)getpid(), __ATOMIC_RELAXED);
+  ring_beat(lead);
+
+  if(__atomic_load_n(&lead->handoff, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&lead->handoff, 0, __ATOMIC_RELEASE);
+    futex_wake(&lead->handoff, 1);
+  }
+}
+
+void ring_beat(ring_t* lead) {
+  __atomic_store_n(&lead->heartbeat, monotonic_ns(), __ATOMIC_RELAXED);
+}
+
+void ring_record_gen_time(ring_t* lead, uint64_t ns) {
+  // Only this producer writes it, the master only reads it
+  uint64_t* count = &lead->gen_time_hist[time_bucket(ns, GEN_TIME_BUCKETS)];
+  __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&lead->gen_time_total, lead->gen_time_total + ns,
+		   __ATOMIC_RELAXED);
+}
+
+uint64_t ring_heartbeat_age_ms(ring_t* lead) {
+  uint64_t heartbeat = __atomic_load_n(&lead->heartbeat, __ATOMIC_RELAXED);
+  uint64_t now = monotonic_ns();
+  return now > heartbeat ? (now - heartbeat) / 1000000 : 0;
+}
+
+void* ring_peek(ring_t* ring) {
+  // Only the consumer writes read, so a relaxed load is enough
+  uint64_t read = __atomic_load_n(&ring->read, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  if(head == read) {
+    return NULL;
+  }
+
+  uint64_t pos = read % ring->size;
+
+  // Producer wrapped, skip to the beginning of the ring (the skipped bytes
+  // are given back once the tail catches up)
+  if(*(uint64_t*)(ring_data(ring) + pos) == NO_SPACE_TO_PRODUCE) {
+    read += ring->size - pos;
+    __atomic_store_n(&ring->read, read, __ATOMIC_RELAXED);
+    if(head == read) {
+      return NULL;
+    }
+    pos = 0;
+  }
+
+  return ring_data(ring) + pos;
+}
+
+void ring_advance(ring_t* ring, uint64_t len) {
+  uint64_t read = __atomic_load_n(&ring->read, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring->read, read + len, __ATOMIC_RELAXED);
+}
+
+void* ring_at(ring_t* ring, uint64_t pos) {
+  return ring_data(ring) + pos % ring->size;
+}
+
+void ring_release(ring_t* ring, uint64_t len) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+  // Release so the record is fully read before the producer may reuse it
+  __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+
+  // Wake up the producer if it is waiting for space
+  ring_t* lead = ring_lead(ring);
+  __atomic_add_fetch(&lead->tail_seq, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&lead->producer_waiting, __ATOMIC_SEQ_CST)) {
+    futex_wake(&lead->tail_seq, 1);
+  }
+}
+
+uint64_t ring_fill(ring_t* ring) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+void ring_set_parked(ring_t* lead, int parked) {
+  __atomic_store_n(&lead->parked, parked ? 1 : 0, __ATOMIC_RELEASE);
+  if(!parked) {
+    futex_wake(&lead->parked, 1);
+  }
+}
+
+int attach_consumer(void* buff, uint32_t consumer) {
+  uint32_t* pid = &get_consumer(buff, consumer)->pid;
+  uint32_t self = (uint32_t)getpid();
+
+  uint32_t old = __atomic_load_n(pid, __ATOMIC_ACQUIRE);
+  do {
+    // A consumer that died may be replaced
+    if(old != 0 && old != self
+       && (kill((pid_t)old, 0) == 0 || errno != ESRCH)) {
+      return 0;
+    }
+  } while(!__atomic_compare_exchange_n(pid, &old, self, 0, __ATOMIC_ACQ_REL,
+				       __ATOMIC_ACQUIRE));
+  return 1;
+}
+
+void detach_consumer(void* buff, uint32_t consumer) {
+  uint32_t* pid = &get_consumer(buff, consumer)->pid;
+  uint32_t self = (uint32_t)getpid();
+  __atomic_compare_exchange_n(pid, &self, 0, 0, __ATOMIC_ACQ_REL,
+			      __ATOMIC_ACQUIRE);
+}
+
+uint32_t get_data_seq(void* buff, uint32_t consumer) {
+  return __atomic_load_n(&get_consumer(buff, consumer)->data_seq,
+			 __ATOMIC_ACQUIRE);
+}
+
+void wait_for_data(void* buff, uint32_t consumer, uint32_t seq,
+		   int timeout_ms) {
+  consumer_t* state = get_consumer(buff, consumer);
+  uint64_t start = monotonic_ns();
+  __atomic_store_n(&state->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+  futex_wait(&state->data_seq, seq, timeout_ms);
+  __atomic_store_n(&state->consumer_waiting, 0, __ATOMIC_RELAXED);
+
+  // Charged to the next sample acquired (see consumer_count_sample)
+  state->wait_pending += monotonic_ns() - start;
+}
 
-  // apply sop to semaphore `semid`
-  semop(semid, &sop, 1); 
+void consumer_count_sample(void* buff, uint32_t consumer, uint64_t bytes) {
+  // Only this consumer writes them, the metrics only read them
+  consumer_t* state = get_consumer(buff, consumer);
+  uint64_t waited = state->wait_pending;
+  uint64_t* count =
+    &state->wait_hist[time_bucket(waited, CONSUMER_WAIT_BUCKETS)];
+  __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&state->wait_total, state->wait_total + waited,
+		   __ATOMIC_RELAXED);
+  __atomic_store_n(&state->consumed_bytes, state->consumed_bytes + bytes,
+		   __ATOMIC_RELAXED);
+  __atomic_store_n(&state->consumed, state->consumed + 1, __ATOMIC_RELAXED);
+  state->wait_pending = 0;
 }
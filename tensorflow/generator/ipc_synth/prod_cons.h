@@ -1,43 +1,318 @@
 #ifndef PROD_CONS_H
+#define PROD_CONS_H
 
 #include <stdint.h>
 
-// 1 GB
-#define SHM_SIZE 1073741824
+// Default size of the shared buffer (1 GB)
+#define DEFAULT_SHM_SIZE (uint64_t)1073741824
 
-// Upper limit to word length
-#define MAX_WORD_LENGTH 63
+// Huge page backed buffers are rounded up to a multiple of this
+#define HUGE_PAGE_SIZE (uint64_t)2097152
 
-// Offset into buffer where data chunks are stored
-#define START_BUFF_OFFSET (sizeof(uint64_t)*2)
+// NUMA nodes the shared buffer can be bound to (see bind_shared_buff)
+#define MAX_NUMA_NODES 1024
 
-// magic num to specify 'able to consume' ("eat!")
-#define SHOULD_CONSUME ((uint64_t)0x21746165)
+// Environment variable telling exec'd producers the fd of the shared buff
+#define SHM_FD_ENV "MTS_IPC_FD"
 
-// magic num to specify that a chunk has already been consumed ("used")
-#define ALREADY_CONSUMED ((uint64_t)0x64657375)
+// Size of a cache line -- ring indices are padded to this to avoid
+// false sharing between the producer and the consumer
+#define CACHE_LINE_SIZE 64
 
-// Size of chunk w/o image
-#define BASE_CHUNK_SIZE sizeof(uint64_t) + (MAX_WORD_LENGTH + 1)*sizeof(char) \
-                        + sizeof(uint64_t) + sizeof(uint64_t)
+// Round up to the 8 byte alignment of records in a ring
+#define RECORD_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+// magic num at the start of every record ("MTSR")
+#define RECORD_MAGIC ((uint32_t)0x5253544d)
+
+// Version of the record layout below
+#define RECORD_VERSION 2
+
+// Record flags
+#define RECORD_FLAG_CHECKSUM 0x1  // checksum field is valid
+#define RECORD_FLAG_RELEASED 0x2  // consumer is done with the record
+
+// Uncomment to have producers checksum every record (consumer verifies
+// any record that carries a checksum)
+//#define WRITE_RECORD_CHECKSUMS
 
 // Magic number for producers to write to tell consumer to wrap
 #define NO_SPACE_TO_PRODUCE (uint64_t)0xc001be9
 
+
+// Buckets of the sample generation time histogram of each producer
+// (log2 of us, see time_bucket)
+#define GEN_TIME_BUCKETS 23
+
+// Buckets of the histogram of the time each consumer waited for a sample
+// (log2 of us, MTS_IPC_WAIT_BUCKETS of mts_ipc.h)
+#define CONSUMER_WAIT_BUCKETS 32
+
+// Longest a producer or the consumer sleeps before checking its ring again
+// (wakeups are explicit, this only bounds the cost of a lost wakeup)
+#define FUTEX_WAIT_TIMEOUT_MS 1000
+
+/*
+ * A record holds one sample:
+ *
+ *   [record_header_t][label + '\0'][pad to 8][image rows][pad to 8]
+ *
+ * rec_len covers all of it, so the next record starts rec_len bytes later.
+ */
+typedef struct record_header {
+  uint32_t magic;      // RECORD_MAGIC
+  uint16_t version;    // RECORD_VERSION
+  uint16_t flags;      // RECORD_FLAG_*
+  uint32_t rec_len;    // bytes in the whole record (multiple of 8)
+  uint32_t width;      // image width in pixels
+  uint32_t height;     // image height in pixels
+  uint32_t stride;     // bytes between image rows
+  uint32_t label_len;  // bytes in the label (without the '\0')
+  uint32_t checksum;   // of label and image, if RECORD_FLAG_CHECKSUM
+  uint64_t seq;        // number of records written to the ring before this
+  uint32_t bg_features;          // MTSSampleInfo::bg_features
+  uint32_t dropped_bg_features;  // MTSSampleInfo::dropped_bg_features
+} record_header_t;
+
+/*
+ * Layout of the shared buffer:
+ *
+ *   [shm_header_t][consumer_t 0][consumer_t 1]...[ring_t 0][ring 0 data]...
+ *
+ * There is a ring for every (producer, consumer) pair, the rings of
+ * producer p being p*num_consumers ... p*num_consumers + num_consumers-1.
+ * A producer is the only writer of its rings and deals its records out
+ * round-robin over them, skipping rings that are full, so every consumer
+ * gets a disjoint share and the free space of a ring is the credit its
+ * consumer has: a slow consumer only stops receiving, it never holds a
+ * producer up while another consumer has room. State about the producer
+ * rather than a single ring (heartbeat, owner, handoff, parking and the
+ * word the producer sleeps on) lives in its first, "lead", ring.
+ *
+ * head and tail are monotonically increasing byte counters (position in
+ * the ring is counter % size), so head - tail is the number of bytes still
+ * in use. The consumer reads records at its own read counter
+ * (tail <= read <= head) and only moves tail over records that have been
+ * released, so records can be handed out without copying and released in
+ * any order.
+ *
+ * Sleeping is done with futexes on 32 bit sequence words: producers bump
+ * their consumer's data_seq after every commit and wake the consumer if it
+ * is waiting, consumers bump the lead ring's tail_seq after every release
+ * and wake the producer if it is waiting for space.
+ */
+
+// Start of the shared buffer
+typedef struct shm_header {
+  uint64_t num_rings;
+  uint64_t ring_size;  // bytes of record data in each ring
+  uint64_t recycle_samples;  // producers retire after this many samples
+  uint64_t recycle_rss;      // or once their RSS reaches this (bytes)
+  uint64_t shm_size;         // bytes in the whole shared buffer
+  uint64_t num_consumers;
+  char pad[CACHE_LINE_SIZE - 6*sizeof(uint64_t)];
+} shm_header_t;
+
+// State of one consumer
+typedef struct consumer {
+  // Bumped by producers whenever a record is published to this consumer
+  uint32_t data_seq;
+  uint32_t consumer_waiting;
+  uint32_t pid;  // process attached as this consumer (0 if none)
+  char pad[CACHE_LINE_SIZE - 3*sizeof(uint32_t)];
+
+  // Written by whoever consumes as this consumer (in wait_for_data and
+  // ipc_acquire_sample), read for the metrics
+  uint64_t consumed;        // samples acquired
+  uint64_t consumed_bytes;  // bytes of their records
+  uint64_t wait_pending;    // ns waited since the last sample was acquired
+  uint64_t wait_total;      // ns waited for the samples acquired
+  uint64_t wait_hist[CONSUMER_WAIT_BUCKETS];  // samples by wait, log2 us
+  char stats_pad[CACHE_LINE_SIZE - (4 + CONSUMER_WAIT_BUCKETS)
+		 * sizeof(uint64_t) % CACHE_LINE_SIZE];
+} consumer_t;
+
+// Ring control block, followed directly by the ring's record data
+typedef struct ring {
+  // Read-only after init_rings
+  uint64_t size;
+  uint64_t index;
+  uint64_t offset;    // of this control block in the shared buffer
+  uint32_t producer;
+  uint32_t consumer;
+  char info_pad[CACHE_LINE_SIZE - 3*sizeof(uint64_t) - 2*sizeof(uint32_t)];
+
+  // Written by the producer only (handoff also by its replacement)
+  uint64_t head;
+  uint64_t next_seq;
+  uint64_t heartbeat;  // CLOCK_MONOTONIC ns when the producer was last alive
+  uint32_t owner_pid;  // producer that last took the ring over
+  uint32_t handoff;    // nonzero while a retiring producer waits to be replaced
+  uint32_t next_consumer;  // (lead ring) who gets the producer's next record
+  char head_pad[CACHE_LINE_SIZE - 3*sizeof(uint64_t) - 3*sizeof(uint32_t)];
+
+  // Written by the consumer (producer_waiting by the producer)
+  uint64_t tail;
+  uint64_t read;
+  uint64_t read_seq;  // seq the next record read should have
+  uint32_t tail_seq;
+  uint32_t producer_waiting;
+  uint32_t parked;  // nonzero while the producer should stop producing
+  char tail_pad[CACHE_LINE_SIZE - 3*sizeof(uint64_t) - 3*sizeof(uint32_t)];
+
+  // Written by the producer only (lead ring): samples by how long they
+  // took to generate, and the total time taken, kept across restarts
+  uint64_t gen_time_hist[GEN_TIME_BUCKETS];
+  uint64_t gen_time_total;  // ns
+} ring_t;
+
+/* Request from the master to a zygote producer to fork a new producer */
+typedef struct spawn_request {
+  uint32_t producer;  // index of the rings the new producer writes to
+  int32_t cpu;        // CPU to pin the new producer to (-1: the zygote's)
+  uint64_t seed;  // seed of the new producer's synthesizer
+} spawn_request_t;
+
+// Log2 bucket of a duration of ns: 0 for less than 1 us, k for
+// [2^(k-1), 2^k) us, num_buckets-1 for anything longer
+int time_bucket(uint64_t ns, int num_buckets);
+
+/* Records */
+// Size of a record with the given label length and image
+uint64_t record_size(uint32_t label_len, uint32_t stride, uint32_t height);
+
+// Label of a record ('\0' terminated)
+char* record_label(record_header_t* rec);
+
+// Image of a record
+unsigned char* record_image(record_header_t* rec);
+
+// Checksum of the label and image of a record
+uint32_t record_checksum(record_header_t* rec);
+
 /* Exposed functions below -- abstract away the nits grits of UNIX IPC */
-// Get ptr to shared buff
-void* get_shared_buff(int create);
+// Create an anonymous shared buff (a memfd) of size bytes, backed by huge
+// pages if huge_pages and enough of them are reserved. Returns its fd. Its
+// pages are only faulted in once touched, and it is freed once the last
+// process using it exits.
+int create_shared_fd(uint64_t size, int huge_pages);
+
+// Bytes in the shared buff of fd (its size rounded up to whole huge pages
+// if it is backed by them)
+uint64_t shared_fd_size(int fd);
+
+// Map the shared buff of fd
+void* map_shared_buff(int fd);
+
+// Allocate every page of the shared buff (mapped from fd) on NUMA node,
+// before anything else touches it. Returns 0, leaving the pages to the
+// default policy, if they can't be bound there.
+int bind_shared_buff(int fd, void* buff, int node);
+
+// Hand the shared buff fd down to a child that is about to exec
+void pass_shared_fd(int fd);
+
+// Get ptr to the shared buff handed down by the parent
+void* get_shared_buff(void);
+
+// Unmap the shared buff
+void release_shared_buff(void* buff);
+
+// Split the shared buff of size bytes into empty rings for num_producers
+// producers and num_consumers consumers
+void init_rings(void* buff, uint32_t num_producers, uint32_t num_consumers,
+		uint64_t size);
+
+// Get number of rings in the shared buff
+uint32_t get_num_rings(void* buff);
+
+// Get number of producers and consumers the shared buff is split between
+uint32_t get_num_producers(void* buff);
+uint32_t get_num_consumers(void* buff);
+
+// Get ring by index
+ring_t* get_ring(void* buff, uint32_t index);
+
+// Get the ring producer writes to for consumer
+ring_t* get_producer_ring(void* buff, uint32_t producer, uint32_t consumer);
+
+// Get the lead ring of the producer of a ring
+ring_t* ring_lead(ring_t* ring);
+
+/* Producer side (ring_* functions below take the lead ring, except for
+ * ring_reserve and ring_commit) */
+// Wait until one of the producer's rings has len contiguous bytes free and
+// return it, going round-robin over the consumers
+// (NULL if a record of len bytes can never fit in a ring)
+ring_t* ring_select(ring_t* lead, uint64_t len);
+
+// Wait until len contiguous bytes are free and return where to write them
+// (NULL if a record of len bytes can never fit in the ring)
+void* ring_reserve(ring_t* ring, uint64_t len);
+
+// Publish len bytes written at the location given by ring_reserve
+void ring_commit(ring_t* ring, uint64_t len);
+
+// Sleep for as long as the producer is parked
+void ring_wait_while_parked(ring_t* lead);
+
+// Retire from the rings: ask supervisor (with SIGUSR1) for a replacement
+// and wait until it has taken over, or timeout_ms passes. Nothing may be
+// written to the rings afterwards.
+void ring_hand_off(ring_t* lead, int supervisor, int timeout_ms);
+
+// Become the rings' owner, taking them over from a producer waiting in
+// ring_hand_off, if any
+void ring_take_over(ring_t* lead);
+
+// Let the consumers know the producer is alive (done on every commit and
+// while waiting)
+void ring_beat(ring_t* lead);
+
+// Count a sample that took ns to generate
+void ring_record_gen_time(ring_t* lead, uint64_t ns);
+
+/* Consumer side */
+// Get the next record to read, or NULL if there is none
+void* ring_peek(ring_t* ring);
+
+// Move the read counter past a record of len bytes
+void ring_advance(ring_t* ring, uint64_t len);
+
+// Get the record at byte counter pos (between tail and read)
+void* ring_at(ring_t* ring, uint64_t pos);
+
+// Give len bytes at the tail back to the producer
+void ring_release(ring_t* ring, uint64_t len);
+
+// Milliseconds since the producer of a lead ring was last known to be alive
+uint64_t ring_heartbeat_age_ms(ring_t* lead);
+
+// Bytes of the ring in use (published or being read)
+uint64_t ring_fill(ring_t* ring);
+
+// Park (stop) or unpark the producer of a lead ring, waking it if unparked
+void ring_set_parked(ring_t* lead, int parked);
+
+// Get consumer state by index
+consumer_t* get_consumer(void* buff, uint32_t consumer);
+
+// Become consumer (fails, returning 0, if a live process already is)
+int attach_consumer(void* buff, uint32_t consumer);
 
-// Get semid
-int get_semaphores(int create);
+// Stop being consumer, so another process may attach as it
+void detach_consumer(void* buff, uint32_t consumer);
 
-// Get shmid
-int get_shmid(int create);
+// Get the current value of a consumer's data sequence number
+uint32_t get_data_seq(void* buff, uint32_t consumer);
 
-// Lock buff (by semid)
-void lock_buff(int semid);
+// Sleep until a producer publishes a record for consumer after its data_seq
+// was seq (or timeout_ms passes)
+void wait_for_data(void* buff, uint32_t consumer, uint32_t seq,
+		   int timeout_ms);
 
-// Unlock buff (by semid)
-void unlock_buff(int semid);
+// Count a sample of bytes acquired by consumer, with the time it waited for
+// it, in the consumer's statistics
+void consumer_count_sample(void* buff, uint32_t consumer, uint64_t bytes);
 
 #endif
@@ -2,13 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
-#include <sys/sem.h>
 #include <opencv2/opencv.hpp>
 #include <signal.h>
 #include <unistd.h>
-#include <linux/membarrier.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 
 #include "map_text_synthesizer.hpp"
 
@@ -19,161 +20,228 @@ extern "C" {
 // Necessary for signal handler
 void* g_buff;
 
-/* Write sample data into buff naively */
-void write_data(intptr_t buff, uint32_t height,
-		const char* label, uint64_t img_sz, unsigned char* img_flat) {
-  /* Data integrity verification */
-  uint8_t data = 0;
-  //  if(memmem((void*)buff, img_sz+BASE_CHUNK_SIZE,(void*)&data, 1)) {
-    //    fprintf(stderr, "Wrote bad data...\n");
-    /*
-    for(int i = 1; i <= img_sz+BASE_CHUNK_SIZE; i++) {
-      fprintf(stderr, "%02x ", ((char*)buff)[i-1] & 0xff);
-      if(i % 8 == 0 && i != 0) {
-	fprintf(stderr, "\n");
-      }
+// How long a retiring producer waits for its replacement before exiting
+#define HANDOFF_TIMEOUT_MS 10000
+
+/* Write sample data into a record at buff */
+void write_record(record_header_t* rec, uint64_t rec_len, uint64_t seq,
+		  const std::string& label, const cv::Mat& image,
+		  const MTSSampleInfo& info) {
+  rec->magic = RECORD_MAGIC;
+  rec->version = RECORD_VERSION;
+  rec->flags = 0;
+  rec->rec_len = (uint32_t)rec_len;
+  rec->width = image.cols;
+  rec->height = image.rows;
+  rec->stride = image.cols;
+  rec->label_len = (uint32_t)label.length();
+  rec->checksum = 0;
+  rec->seq = seq;
+  rec->bg_features = info.bg_features;
+  rec->dropped_bg_features = info.dropped_bg_features;
+
+  // Write label (with its terminator)
+  memcpy(record_label(rec), label.c_str(), label.length() + 1);
+
+  // Write image rows, packed
+  unsigned char* img = record_image(rec);
+  if(image.isContinuous()) {
+    memcpy(img, image.data, (size_t)image.rows * image.cols);
+  } else {
+    for(int r = 0; r < image.rows; r++) {
+      memcpy(img + (size_t)r * image.cols, image.ptr(r), image.cols);
     }
-    fprintf(stderr, "\n");
-    */
-  //}
+  }
 
-  //__sync_synchronize();
-  /* Keep track of start to write to later */
-  uint64_t* start_buff = (uint64_t*)buff;
-  
-  /* Skip past first 8 bytes (to write to-be-consumed magic num later */
-  buff += sizeof(uint64_t);
-
-  // 8 byte bc 4 byte wouldn't have the 8 byte alignment...
-  *(uint64_t*)buff = height;
-  buff += sizeof(uint64_t);
-
-  // Write label into buff, and update buff
-  strcpy((char*)buff, label);
-  buff += (MAX_WORD_LENGTH + 1) * sizeof(char);
-
-  // Write img_sz into buff, and update buff
-  *(uint64_t*)buff = img_sz;
-  buff += sizeof(uint64_t);
-
-  // Write image into buff, and update buff
-  memcpy((unsigned char*)buff, img_flat, img_sz);
-  buff += img_sz * sizeof(unsigned char);
-
-  // Memory fencing to prevent possible badness btwn prod/cons
-  asm volatile ("mfence" ::: "memory");
-      
-  // Mark as consumable
-  *start_buff = SHOULD_CONSUME;
+#ifdef WRITE_RECORD_CHECKSUMS
+  rec->checksum = record_checksum(rec);
+  rec->flags |= RECORD_FLAG_CHECKSUM;
+#endif
 }
 
-/* Create synthesizer and produce until signaled */
-void produce(intptr_t buff, int semid, const char* config_file) {
+/* Resident set size of this process in bytes */
+uint64_t get_rss(void) {
+  unsigned long size, resident = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if(statm != NULL) {
+    if(fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(statm);
+  }
+  return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
 
-  // Create mts according to config file
-  cv::Ptr<MapTextSynthesizer> mts = MapTextSynthesizer::create(config_file);
+/* Whether this producer should retire, after making num_samples samples */
+int should_recycle(uint64_t num_samples) {
+  shm_header_t* header = (shm_header_t*)g_buff;
+  return (header->recycle_samples != 0
+	  && num_samples >= header->recycle_samples)
+    || (header->recycle_rss != 0 && get_rss() >= header->recycle_rss);
+}
+
+/* Produce into the rings of lead with mts until signaled, or until it is
+ * time to hand them over to a fresh producer */
+void produce(ring_t* lead, cv::Ptr<MapTextSynthesizer> mts) {
 
   // Allocate some stack space for MTS data
   std::string label;
   cv::Mat image;
   int height;
+  MTSSampleInfo info;
+  uint64_t num_samples = 0;
 
-  // Produce loop (terminates only by signal)
+  // Produce loop (terminates by signal, or once recycled)
   while(1) {
+    // Don't use the CPU while the master has no use for this producer
+    ring_wait_while_parked(lead);
+
     // Fill label, image, height with data from next synth sample
-    mts->generateSample(label, image, height);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mts->generateSample(label, image, height, info);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ring_record_gen_time(lead, (uint64_t)(end.tv_sec - start.tv_sec)
+			 * 1000000000 + end.tv_nsec - start.tv_nsec);
     
     // Ensure something was created
     if(image.data == NULL || label.c_str() == NULL) {
       fprintf(stderr, "Nothing generated by synthesizer.\n");
       exit(1);
     }
-    if(label.length() > MAX_WORD_LENGTH) {
-      fprintf(stderr, "IPC_SYNTH_ERROR: MTS produced an image larger than MAX_WORD_LENGTH. Update macro in prod_cons.h or remove this word from your caption list.\nOffending word: %s\nSkipping this word!\n", label.c_str());
-      continue;
-    }
-    // Calculate image size w/ 1 channel
-    uint64_t image_size = image.rows * image.cols;
-    
-    /* Get & update the producer offset atomically */
-    lock_buff(semid);
-    
-    // Save write loc
-    intptr_t write_loc = buff + *((uint64_t*)buff);
 
-    /* Calculate & update producer offset for future producers */
-    
-    // If there's no space to fit this image in the current buff
-    if(((*(uint64_t*)buff) + BASE_CHUNK_SIZE + image_size) > SHM_SIZE) {
-
-      // Write in magic number to tell consumer to reset consume offset
-      if(((*(uint64_t*)buff) + sizeof(uint64_t)) > SHM_SIZE) {
-	// Can't fit magic num, this case is handled on the consumer-side
-      } else {
-	*((uint64_t*)write_loc) = NO_SPACE_TO_PRODUCE;
-      }
-      
-      // Reset offset
-      *((uint64_t*)buff) = START_BUFF_OFFSET;
-      write_loc = buff + *((uint64_t*)buff);
-    }
-
-    // Update producer offset
-    *((uint64_t*)buff) += (BASE_CHUNK_SIZE + image_size);
+    // Size of the record (1 channel image)
+    uint64_t rec_len = record_size(label.length(), image.cols, image.rows);
 
-    // Force 8 byte alignment
-    if(*((uint64_t*)buff) % 8 != 0 &&
-       *((uint64_t*)buff) + (*((uint64_t*)buff) % 8) < SHM_SIZE) {
-      *((uint64_t*)buff) += *((uint64_t*)buff) % 8;
-    }
-    
-    // Check out the consume_offset 
-    uint64_t volatile consume_offset = *((uint64_t volatile*)(buff+sizeof(uint64_t)));
-    
-    /* Sleep until producer-consumer offsets have 
-     * cleared memory corruption territory...
-     * (checking if current producer offset is less than consume offset, and
-     * that the producer offset is greater than the consume offset 
-     * (ie a write that would corrupt memory)
-     */
-    while(write_loc - buff < consume_offset
-	  && *((uint64_t*)buff) >= consume_offset) {
-      sleep(5); // 5 is arbitrary
-      
-      // Update consume offset
-      consume_offset = *((uint64_t volatile*)(buff+sizeof(uint64_t)));
+    // Wait for room in the ring of the next consumer that has any
+    ring_t* ring = ring_select(lead, rec_len);
+    void* write_loc = ring != NULL ? ring_reserve(ring, rec_len) : NULL;
+    if(write_loc == NULL) {
+      fprintf(stderr, "IPC_SYNTH_ERROR: sample of %lu bytes does not fit in the ring. Skipping this sample!\n", rec_len);
+      continue;
     }
 
+    /* Write data into buff, then make it visible to the consumer */
+    write_record((record_header_t*)write_loc, rec_len, ring->next_seq,
+		 label, image, info);
+    ring->next_seq++;
+    ring_commit(ring, rec_len);
 
-    /* Verify no bad overwritage would occur */
-    
-    uint8_t needle = (uint8_t)SHOULD_CONSUME;
-    while(memmem((void*)write_loc, (*((uint64_t*)buff)+buff) - write_loc,
-	       (void*)&needle, sizeof(uint8_t))) {
-      sleep(5); // 5 is arbitrary
+    // Retire between records, so the rings are left in a clean state
+    if(should_recycle(++num_samples)) {
+      ring_hand_off(lead, getppid(), HANDOFF_TIMEOUT_MS);
+      return;
     }
-    
-    unlock_buff(semid);
-
-    /* Write data into buff */
-    write_data(write_loc, height, label.c_str(),
-	       image_size, image.data);
   }
 }
 
 /* Signal handler */
 void cleanup(int signo) {
+  (void)signo;
   /* detach from segment */
-  if(shmdt(g_buff) == -1) {
-    perror("shmdt");
-  }
+  release_shared_buff(g_buff);
   exit(1);
 }
 
+/* Attach to the rings of producer and produce into them with the given
+ * seed */
+void run_producer(cv::Ptr<MapTextSynthesizer> mts, uint32_t producer,
+		  uint64_t seed) {
+  if(producer >= get_num_producers(g_buff)) {
+    fprintf(stderr, "producer: no producer %u in shared buffer\n", producer);
+    exit(1);
+  }
+
+  mts->setSeed(seed);
+
+  // Only start writing once the synthesizer is ready, so a retiring
+  // producer keeps the rings busy until then
+  ring_t* lead = get_producer_ring(g_buff, producer, 0);
+  ring_take_over(lead);
+  produce(lead, mts);
+}
+
+/* Become a producer forked from the zygote. Runs in the grandchild of the
+ * zygote, intermediate being the pid of its parent (taken before the fork,
+ * as that parent may be gone by the time this runs) */
+void become_producer(cv::Ptr<MapTextSynthesizer> mts, pid_t master,
+		     pid_t intermediate, spawn_request_t* req) {
+  // Wait to be adopted by the master (a child subreaper)
+  while(getppid() == intermediate) {
+    usleep(100);
+  }
+
+  // Send SIGHUP to this process when the master dies. This can only be
+  // set once adopted (the intermediate exiting would trigger it), so check
+  // the master is still the parent only after, in case it died in between
+  prctl(PR_SET_PDEATHSIG, SIGHUP);
+  if(getppid() != master) {
+    exit(1);
+  }
+
+  // Pin it as asked, it inherited the zygote's CPUs otherwise
+  if(req->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(req->cpu, &cpus);
+    if(sched_setaffinity(0, sizeof(cpus), &cpus)) {
+      perror("sched_setaffinity");
+      exit(1);
+    }
+  }
+
+  // Requests are for the zygote only
+  int devnull = open("/dev/null", O_RDWR);
+  dup2(devnull, STDIN_FILENO);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+
+  run_producer(mts, req->producer, req->seed);
+}
+
+/* Warm up one synthesizer, then fork a producer from it for every spawn
+ * request read from stdin. The pid of each new producer is written to
+ * stdout. Producers share the zygote's fonts and captions copy-on-write. */
+void zygote(const char* config_file) {
+  cv::Ptr<MapTextSynthesizer> mts = MapTextSynthesizer::create(config_file);
+
+  // Render once so that fontconfig and pango caches are loaded
+  std::string label;
+  cv::Mat image;
+  int height;
+  mts->generateSample(label, image, height);
+
+  pid_t master = getppid();
+  spawn_request_t req;
+
+  // Serve requests until the master closes the pipe
+  while(read(STDIN_FILENO, &req, sizeof(req)) == sizeof(req)) {
+    pid_t intermediate = fork();
+    if(intermediate == -1) {
+      perror("zygote fork");
+      exit(1);
+    } else if(intermediate == 0) {
+      // Fork again so the producer is reparented to the master, which
+      // then gets its SIGCHLD
+      pid_t intermediate_pid = getpid();
+      pid_t producer = fork();
+      if(producer == 0) {
+	become_producer(mts, master, intermediate_pid, &req);
+	exit(0);
+      }
+      write(STDOUT_FILENO, &producer, sizeof(producer));
+      _exit(0);
+    }
+    waitpid(intermediate, NULL, 0);
+  }
+}
+
 /* main */
 int main(int argc, char *argv[]) {
-  if(argc != 2) {
-    fprintf(stderr,"usage: producer \"/path/to/config_file\"");
+  int is_zygote = argc == 3 && strcmp(argv[1], "--zygote") == 0;
+  if(argc != 4 && !is_zygote) {
+    fprintf(stderr,"usage: producer \"/path/to/config_file\" producer_index seed\n"
+	    "       producer --zygote \"/path/to/config_file\"\n");
     exit(1);
   }
   
@@ -181,17 +249,18 @@ int main(int argc, char *argv[]) {
   sa.sa_handler = cleanup;
   sigaction(SIGHUP, NULL, &sa);
   
-  g_buff = get_shared_buff(0);
-  int semid = get_semaphores(0);
-  
-  produce((intptr_t)g_buff, semid, argv[1]);
-  
-  /* detach from segment (NOTE: program ex really shouldn't reach this...) */
-  if(shmdt(g_buff) == -1) {
-    perror("shmdt");
-    exit(1);
+  g_buff = get_shared_buff();
+
+  if(is_zygote) {
+    zygote(argv[2]);
+  } else {
+    // Create mts according to config file
+    cv::Ptr<MapTextSynthesizer> mts = MapTextSynthesizer::create(argv[1]);
+    run_producer(mts, (uint32_t)atoi(argv[2]), strtoull(argv[3], NULL, 10));
   }
   
+  /* detach from segment (only reached once recycled) */
+  release_shared_buff(g_buff);
+  
   return 0;
 }
-
@@ -21,6 +21,7 @@ import os
 import tensorflow as tf
 import numpy as np
 from data_synth import multithreaded_data_generator as data_generator
+from data_synth import batched_data_generator
 import pipeline
 import charset
 
@@ -70,6 +71,53 @@ def get_dataset( args=None ):
          tf.TensorShape( [None] )) )       # Labels shape
     
 
+def get_batched_dataset( args, batch_size, max_width ):
+    """
+    Get a dataset of whole batches, zero-padded to max_width in C instead
+    of one sample at a time through python
+    Format: [text|image|width|labels] -- types and shapes can be seen below
+    Samples wider than max_width are skipped.
+    """
+
+    def _generator_wrapper():
+        """
+        Wraps batched_data_generator to precompute labels in python
+        Returns:
+        caption : ground truth strings [batch_size]
+        image   : zero-padded images [batch_size, 32, max_width, 1]
+        width   : widths of the images [batch_size]
+        label   : indices corresponding to out_charset plus a temporary
+                  increment, padded with zero (the EOS token) to the
+                  longest caption [batch_size, ?]
+        """
+
+        # Extract args
+        [ config_path, num_producers ] = args[0:2]
+
+        gen = batched_data_generator( config_path, num_producers,
+                                      batch_size, 32, max_width )
+
+        while True:
+            captions, images, widths = next( gen )
+
+            labels = [[index+1 for index in charset.string_to_label(caption)]
+                      for caption in captions]
+            max_len = max( len(label) for label in labels )
+            padded = np.zeros( (batch_size, max_len), dtype=np.int32 )
+            for i, label in enumerate( labels ):
+                padded[i, :len(label)] = label
+
+            yield captions, images, widths, padded
+
+    return tf.data.Dataset.from_generator(
+        _generator_wrapper,
+        (tf.string, tf.uint8, tf.int32, tf.int32),    # Output Types
+        (tf.TensorShape( [batch_size] ),              # Text shape
+         tf.TensorShape( (batch_size, 32, max_width, 1) ), # Image shape
+         tf.TensorShape( [batch_size] ),              # Width shape
+         tf.TensorShape( [batch_size, None] )) )      # Labels shape
+
+
 def preprocess_fn( caption, image, labels ):
     """
     Reformat raw data for model trainer. 
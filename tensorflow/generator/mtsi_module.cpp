@@ -0,0 +1,453 @@
+/*
+   CNN-LSTM-CTC-OCR
+   Python extension module for MTS
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Native counterpart of data_synth.py (Python 3):
+ *
+ *   import mtsi
+ *   gen = mtsi.Generator("config.txt", num_producers=4, prefetch=64)
+ *   caption, image = next(gen)   # image: uint8 [height, width, 1]
+ *   captions, images, widths = gen.next_batch(32, 32, 512)
+ *   caption, image = gen.next_dlpack()   # e.g. torch.from_dlpack(image)
+ *   gen.close()
+ *
+ * Every call goes straight to the MTS_Buffer of textsynthinterface.cpp,
+ * with the GIL released while it waits for or generates samples. Sample
+ * images are handed to NumPy without a copy, the array owning the buffer
+ * through a capsule. The *_dlpack methods hand the same buffers to any
+ * framework that imports DLPack capsules instead.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" {
+#include "ipc_consumer.h"
+#include "dlpack.h"
+  // From textsynthinterface.cpp
+  void* mts_init(const char* config_path, int num_producers);
+  void* mts_prefetch(void* mts_buff, int depth);
+  void* get_sample(void* mts_buff);
+  int get_batch(void* mts_buff, int n, int height, int max_width,
+		unsigned char* out_images, int* out_widths, char** out_labels);
+  int get_batch_float(void* mts_buff, int n, int height, int max_width,
+		      float* out_images, int* out_widths, char** out_labels);
+  DLManagedTensor* get_sample_dlpack(void* mts_buff, char** out_caption);
+  DLManagedTensor* get_batch_dlpack(void* mts_buff, int n, int height,
+				    int max_width, int normalize,
+				    DLManagedTensor** out_widths,
+				    char** out_labels);
+  void free_labels(char** labels, int n);
+  void mts_cleanup(void* mts_buff);
+}
+
+typedef struct {
+  PyObject_HEAD
+  void* mts_buff;           // NULL once closed
+  PyThread_type_lock lock;  // one call into mts_buff at a time
+} Generator;
+
+/* Take the generator's lock with the GIL released, so other Python threads
+ * run meanwhile. Returns 0, with an exception set, if it is closed. */
+static int lock_generator(Generator* self) {
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(self->lock, WAIT_LOCK);
+  Py_END_ALLOW_THREADS
+
+  if(self->mts_buff == NULL) {
+    PyThread_release_lock(self->lock);
+    PyErr_SetString(PyExc_ValueError, "generator is closed");
+    return 0;
+  }
+  return 1;
+}
+
+/* Free the image of a sample once its array is gone */
+static void free_image(PyObject* capsule) {
+  free(PyCapsule_GetPointer(capsule, NULL));
+}
+
+/* Turn a heap allocated sample into (caption, image), freeing everything
+ * but the image, which the array takes over */
+static PyObject* sample_to_tuple(sample_t* spl) {
+  unsigned char* img_data = spl->img_data;
+  npy_intp dims[3] = { (npy_intp)spl->height, (npy_intp)spl->width, 1 };
+  PyObject* caption = PyUnicode_DecodeUTF8(spl->caption,
+					   strlen(spl->caption), "replace");
+  free(spl->caption);
+  free(spl);
+
+  PyObject* owner = PyCapsule_New(img_data, NULL, free_image);
+  if(owner == NULL) {
+    free(img_data);
+    Py_XDECREF(caption);
+    return NULL;
+  }
+  PyObject* image = PyArray_SimpleNewFromData(3, dims, NPY_UINT8, img_data);
+  if(image == NULL) {
+    Py_DECREF(owner);
+    Py_XDECREF(caption);
+    return NULL;
+  }
+  // Steals owner, even on failure
+  if(PyArray_SetBaseObject((PyArrayObject*)image, owner) < 0
+     || caption == NULL) {
+    Py_DECREF(image);
+    Py_XDECREF(caption);
+    return NULL;
+  }
+
+  return Py_BuildValue("NN", caption, image);
+}
+
+/* Free a DLPack tensor that no framework took (one that did renames the
+ * capsule to "used_dltensor" and calls the deleter itself) */
+static void free_dltensor(PyObject* capsule) {
+  if(PyCapsule_IsValid(capsule, "dltensor")) {
+    DLManagedTensor* managed =
+      (DLManagedTensor*)PyCapsule_GetPointer(capsule, "dltensor");
+    managed->deleter(managed);
+  }
+}
+
+/* Wrap a DLPack tensor in the capsule frameworks import it from */
+static PyObject* to_dlpack(DLManagedTensor* managed) {
+  PyObject* capsule = PyCapsule_New(managed, "dltensor", free_dltensor);
+  if(capsule == NULL) {
+    managed->deleter(managed);
+  }
+  return capsule;
+}
+
+/* Captions from a batch as a list, freeing them */
+static PyObject* labels_to_list(char** labels, int n) {
+  PyObject* captions = PyList_New(n);
+  for(int i = 0; captions != NULL && i < n; i++) {
+    PyObject* caption = PyUnicode_DecodeUTF8(labels[i], strlen(labels[i]),
+					     "replace");
+    if(caption == NULL) {
+      Py_CLEAR(captions);
+    } else {
+      PyList_SET_ITEM(captions, i, caption);
+    }
+  }
+  free_labels(labels, n);
+  return captions;
+}
+
+static int Generator_init(Generator* self, PyObject* args, PyObject* kwds) {
+  static const char* kwlist[] = { "config_file", "num_producers", "prefetch",
+				  NULL };
+  const char* config_file;
+  int num_producers = 0;
+  int prefetch = 0;
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|ii", (char**)kwlist,
+				  &config_file, &num_producers, &prefetch)) {
+    return -1;
+  }
+  if(self->lock != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "generator is already initialized");
+    return -1;
+  }
+
+  self->lock = PyThread_allocate_lock();
+  if(self->lock == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  // Loading the synthesizer or starting producers takes a while.
+  // config_file is borrowed from args, so only for this call: the
+  // synthesizer and mts_ipc_init_opts keep copies of it for respawns
+  void* mts_buff;
+  Py_BEGIN_ALLOW_THREADS
+  mts_buff = mts_init(config_file, num_producers);
+  if(prefetch > 0) {
+    mts_buff = mts_prefetch(mts_buff, prefetch);
+  }
+  Py_END_ALLOW_THREADS
+  self->mts_buff = mts_buff;
+
+  return 0;
+}
+
+/* Shut down producers and prefetching, waiting for a call in progress */
+static PyObject* Generator_close(Generator* self, PyObject* unused) {
+  (void)unused;
+  if(self->lock == NULL) {
+    Py_RETURN_NONE;
+  }
+
+  void* mts_buff;
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(self->lock, WAIT_LOCK);
+  mts_buff = self->mts_buff;
+  self->mts_buff = NULL;
+  if(mts_buff != NULL) {
+    mts_cleanup(mts_buff);
+  }
+  PyThread_release_lock(self->lock);
+  Py_END_ALLOW_THREADS
+
+  Py_RETURN_NONE;
+}
+
+static void Generator_dealloc(Generator* self) {
+  Py_XDECREF(Generator_close(self, NULL));
+  if(self->lock != NULL) {
+    PyThread_free_lock(self->lock);
+  }
+  PyTypeObject* type = Py_TYPE(self);
+  type->tp_free((PyObject*)self);
+  Py_DECREF(type);
+}
+
+static PyObject* Generator_iternext(Generator* self) {
+  if(!lock_generator(self)) {
+    return NULL;
+  }
+
+  sample_t* spl;
+  Py_BEGIN_ALLOW_THREADS
+  spl = (sample_t*)get_sample(self->mts_buff);
+  Py_END_ALLOW_THREADS
+  PyThread_release_lock(self->lock);
+
+  return sample_to_tuple(spl);
+}
+
+/* next_batch(n, height, max_width, normalize=False) -> (captions, images,
+ * widths), as batched_data_generator in data_synth.py */
+static PyObject* Generator_next_batch(Generator* self, PyObject* args,
+				      PyObject* kwds) {
+  static const char* kwlist[] = { "n", "height", "max_width", "normalize",
+				  NULL };
+  int n, height, max_width;
+  int normalize = 0;
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "iii|p", (char**)kwlist, &n,
+				  &height, &max_width, &normalize)) {
+    return NULL;
+  }
+  if(n < 1 || height < 1 || max_width < 1) {
+    PyErr_SetString(PyExc_ValueError,
+		    "n, height and max_width must be positive");
+    return NULL;
+  }
+
+  npy_intp image_dims[4] = { n, height, max_width, 1 };
+  npy_intp width_dims[1] = { n };
+  PyObject* images = PyArray_SimpleNew(4, image_dims,
+				       normalize ? NPY_FLOAT32 : NPY_UINT8);
+  PyObject* widths = PyArray_SimpleNew(1, width_dims, NPY_INT);
+  char** labels = (char**)malloc(n*sizeof(char*));
+  if(images == NULL || widths == NULL || labels == NULL) {
+    if(labels == NULL) {
+      PyErr_NoMemory();
+    }
+    Py_XDECREF(images);
+    Py_XDECREF(widths);
+    free(labels);
+    return NULL;
+  }
+
+  if(!lock_generator(self)) {
+    Py_DECREF(images);
+    Py_DECREF(widths);
+    free(labels);
+    return NULL;
+  }
+
+  // Filled in place, the arrays aren't visible to anyone else yet
+  void* image_data = PyArray_DATA((PyArrayObject*)images);
+  int* width_data = (int*)PyArray_DATA((PyArrayObject*)widths);
+  Py_BEGIN_ALLOW_THREADS
+  if(normalize) {
+    get_batch_float(self->mts_buff, n, height, max_width,
+		    (float*)image_data, width_data, labels);
+  } else {
+    get_batch(self->mts_buff, n, height, max_width,
+	      (unsigned char*)image_data, width_data, labels);
+  }
+  Py_END_ALLOW_THREADS
+  PyThread_release_lock(self->lock);
+
+  PyObject* captions = labels_to_list(labels, n);
+  free(labels);
+
+  if(captions == NULL) {
+    Py_DECREF(images);
+    Py_DECREF(widths);
+    return NULL;
+  }
+  return Py_BuildValue("NNN", captions, images, widths);
+}
+
+/* next_dlpack() -> (caption, image) with image as a DLPack capsule */
+static PyObject* Generator_next_dlpack(Generator* self, PyObject* unused) {
+  (void)unused;
+  if(!lock_generator(self)) {
+    return NULL;
+  }
+
+  DLManagedTensor* image;
+  char* label;
+  Py_BEGIN_ALLOW_THREADS
+  image = get_sample_dlpack(self->mts_buff, &label);
+  Py_END_ALLOW_THREADS
+  PyThread_release_lock(self->lock);
+
+  PyObject* caption = PyUnicode_DecodeUTF8(label, strlen(label), "replace");
+  free(label);
+  PyObject* capsule = to_dlpack(image);
+  if(caption == NULL || capsule == NULL) {
+    Py_XDECREF(caption);
+    Py_XDECREF(capsule);
+    return NULL;
+  }
+  return Py_BuildValue("NN", caption, capsule);
+}
+
+/* next_batch_dlpack(n, height, max_width, normalize=False) -> like
+ * next_batch, with images and widths as DLPack capsules */
+static PyObject* Generator_next_batch_dlpack(Generator* self, PyObject* args,
+					     PyObject* kwds) {
+  static const char* kwlist[] = { "n", "height", "max_width", "normalize",
+				  NULL };
+  int n, height, max_width;
+  int normalize = 0;
+  if(!PyArg_ParseTupleAndKeywords(args, kwds, "iii|p", (char**)kwlist, &n,
+				  &height, &max_width, &normalize)) {
+    return NULL;
+  }
+  if(n < 1 || height < 1 || max_width < 1) {
+    PyErr_SetString(PyExc_ValueError,
+		    "n, height and max_width must be positive");
+    return NULL;
+  }
+
+  char** labels = (char**)malloc(n*sizeof(char*));
+  if(labels == NULL) {
+    return PyErr_NoMemory();
+  }
+  if(!lock_generator(self)) {
+    free(labels);
+    return NULL;
+  }
+
+  DLManagedTensor* images;
+  DLManagedTensor* widths;
+  Py_BEGIN_ALLOW_THREADS
+  images = get_batch_dlpack(self->mts_buff, n, height, max_width, normalize,
+			    &widths, labels);
+  Py_END_ALLOW_THREADS
+  PyThread_release_lock(self->lock);
+
+  if(images == NULL) {
+    free(labels);
+    return PyErr_NoMemory();
+  }
+  PyObject* captions = labels_to_list(labels, n);
+  free(labels);
+  PyObject* images_capsule = to_dlpack(images);
+  PyObject* widths_capsule = to_dlpack(widths);
+  if(captions == NULL || images_capsule == NULL || widths_capsule == NULL) {
+    Py_XDECREF(captions);
+    Py_XDECREF(images_capsule);
+    Py_XDECREF(widths_capsule);
+    return NULL;
+  }
+  return Py_BuildValue("NNN", captions, images_capsule, widths_capsule);
+}
+
+static PyMethodDef Generator_methods[] = {
+  { "next_batch", (PyCFunction)(void(*)(void))Generator_next_batch,
+    METH_VARARGS | METH_KEYWORDS,
+    "next_batch(n, height, max_width, normalize=False)\n"
+    "Next n samples that fit, as (captions, images, widths): images is a\n"
+    "zero-padded [n, height, max_width, 1] uint8 array (float32 in [0,1]\n"
+    "if normalize) and widths an [n] int32 array." },
+  { "next_dlpack", (PyCFunction)Generator_next_dlpack, METH_NOARGS,
+    "next_dlpack()\n"
+    "Next sample as (caption, image), image being a DLPack capsule of a\n"
+    "uint8 [height, width, 1] CPU tensor (e.g. for torch.from_dlpack)." },
+  { "next_batch_dlpack", (PyCFunction)(void(*)(void))Generator_next_batch_dlpack,
+    METH_VARARGS | METH_KEYWORDS,
+    "next_batch_dlpack(n, height, max_width, normalize=False)\n"
+    "Like next_batch, with images and widths as DLPack capsules." },
+  { "close", (PyCFunction)Generator_close, METH_NOARGS,
+    "Stop the producers (or the synthesizer)." },
+  { NULL, NULL, 0, NULL }
+};
+
+static PyType_Slot Generator_slots[] = {
+  { Py_tp_doc, (void*)
+    "Generator(config_file, num_producers=0, prefetch=0)\n"
+    "Iterator of (caption, image) samples, image being a uint8\n"
+    "[height, width, 1] array. With num_producers >= 1 samples come from\n"
+    "producer processes, otherwise from a synthesizer in this one.\n"
+    "prefetch keeps that many samples ready on a background thread.\n"
+    "Only one generator with producers can exist per process." },
+  { Py_tp_init, (void*)Generator_init },
+  { Py_tp_dealloc, (void*)Generator_dealloc },
+  { Py_tp_iter, (void*)PyObject_SelfIter },
+  { Py_tp_iternext, (void*)Generator_iternext },
+  { Py_tp_methods, (void*)Generator_methods },
+  { 0, NULL }
+};
+
+static PyType_Spec Generator_spec = {
+  "mtsi.Generator",
+  sizeof(Generator),
+  0,
+  Py_TPFLAGS_DEFAULT,
+  Generator_slots
+};
+
+static struct PyModuleDef mtsi_module = {
+  PyModuleDef_HEAD_INIT,
+  "mtsi",
+  "MapTextSynthesizer samples as NumPy arrays.",
+  -1,
+  NULL,  // methods
+  NULL,  // slots
+  NULL,  // traverse
+  NULL,  // clear
+  NULL   // free
+};
+
+PyMODINIT_FUNC PyInit_mtsi(void) {
+  import_array();
+
+  PyObject* module = PyModule_Create(&mtsi_module);
+  if(module == NULL) {
+    return NULL;
+  }
+  PyObject* type = PyType_FromSpec(&Generator_spec);
+  if(type == NULL || PyModule_AddObject(module, "Generator", type) < 0) {
+    Py_XDECREF(type);
+    Py_DECREF(module);
+    return NULL;
+  }
+  return module;
+}
@@ -21,16 +21,38 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <mtsynth/map_text_synthesizer.hpp>
 #include <stdio.h>
+#include <signal.h>
 extern "C" {
 #include "mts_ipc.h"
 #include "ipc_consumer.h"
+#include "dlpack.h"
 }
 
+// How often a prefetching worker with a full queue still supervises the
+// producers (mts_ipc_supervise asks for about once a second)
+#define SUPERVISE_INTERVAL_MS 1000
+
 struct MTS_Buffer {
+  virtual ~MTS_Buffer() {}
   virtual void cleanup(void) = 0;
   virtual sample_t* get_sample(void) = 0;
+  // Sample must be given back with release_sample instead of free_sample
+  virtual sample_t* acquire_sample(void) = 0;
+  virtual void release_sample(sample_t* spl) = 0;
+  // See mts_ipc_get_batch (exactly one of out_images(_float) is non-NULL)
+  virtual int get_batch(int n, int height, int max_width,
+			unsigned char* out_images, float* out_images_float,
+			int* out_widths, char** out_labels) = 0;
+  // Look after the producers the buffer started, if any (see
+  // mts_ipc_supervise), for callers that go a while without samples
+  virtual void supervise(void) {}
 };
 
 struct MTS_Singlethreaded : MTS_Buffer {
@@ -38,13 +60,55 @@ struct MTS_Singlethreaded : MTS_Buffer {
   MTS_Singlethreaded(const char* config_path);
   void cleanup(void);
   sample_t* get_sample(void);
+  sample_t* acquire_sample(void);
+  void release_sample(sample_t* spl);
+  int get_batch(int n, int height, int max_width,
+		unsigned char* out_images, float* out_images_float,
+		int* out_widths, char** out_labels);
 };
 
 struct MTS_Multithreaded : MTS_Buffer {
   int num_producers;
-  MTS_Multithreaded(const char* config_path, int num_producers);
+  MTS_Multithreaded(const char* config_path, int num_producers,
+		    int num_consumers = 1);
+  // Producers started with opts (see mts_ipc_opts_t)
+  MTS_Multithreaded(const mts_ipc_opts_t* opts);
+  // Consumer of producers started by another process (see mts_ipc_attach)
+  MTS_Multithreaded(void);
   void cleanup(void);
+  void supervise(void);
   sample_t* get_sample(void);
+  sample_t* acquire_sample(void);
+  void release_sample(sample_t* spl);
+  int get_batch(int n, int height, int max_width,
+		unsigned char* out_images, float* out_images_float,
+		int* out_widths, char** out_labels);
+};
+
+/* Generates samples of another buffer on a background thread, keeping up
+ * to depth of them ready, so that generating the next sample overlaps with
+ * the caller's work on the last one. The producers' SIGCHLD and SIGUSR1 are
+ * blocked in the creating thread (and the threads it starts) until cleanup,
+ * so that they interrupt the worker's waits instead, as in mts_server. */
+struct MTS_Prefetching : MTS_Buffer {
+  MTS_Buffer* source;
+  sigset_t caller_mask;
+  size_t depth;
+  std::deque<sample_t*> ready;
+  std::mutex lock;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  bool stopping;
+  std::thread worker;
+  MTS_Prefetching(MTS_Buffer* source, int depth);
+  void prefetch(void);
+  void cleanup(void);
+  sample_t* get_sample(void);
+  sample_t* acquire_sample(void);
+  void release_sample(sample_t* spl);
+  int get_batch(int n, int height, int max_width,
+		unsigned char* out_images, float* out_images_float,
+		int* out_widths, char** out_labels);
 };
 
 MTS_Singlethreaded::MTS_Singlethreaded(const char* config_file) {
@@ -52,9 +116,24 @@ MTS_Singlethreaded::MTS_Singlethreaded(const char* config_file) {
 }
 
 MTS_Multithreaded::MTS_Multithreaded(const char* config_file, \
-				     int num_producers) {
+				     int num_producers, int num_consumers) {
   this->num_producers = num_producers;
-  mts_ipc_init(num_producers, config_file);  
+
+  mts_ipc_opts_t opts;
+  mts_ipc_default_opts(&opts);
+  opts.num_producers = num_producers;
+  opts.num_consumers = num_consumers;
+  opts.config_file = config_file;
+  mts_ipc_init_opts(&opts);
+}
+
+MTS_Multithreaded::MTS_Multithreaded(const mts_ipc_opts_t* opts) {
+  this->num_producers = opts->num_producers;
+  mts_ipc_init_opts(opts);
+}
+
+MTS_Multithreaded::MTS_Multithreaded(void) {
+  this->num_producers = 0;
 }
 
 sample_t* MTS_Singlethreaded::get_sample(void) {
@@ -63,9 +142,10 @@ sample_t* MTS_Singlethreaded::get_sample(void) {
   std::string label;
   cv::Mat image;
   int height;
+  MTSSampleInfo info;
 
   // Fill in label, image
-  mts->generateSample(label, image, height);
+  mts->generateSample(label, image, height, info);
 
   // Stick the necessary data into sample_t struct
   sample_t* spl;
@@ -86,6 +166,8 @@ sample_t* MTS_Singlethreaded::get_sample(void) {
   memcpy(spl->img_data, image.data, buff_size);
   spl->height = image.rows;
   spl->width = image.cols;
+  spl->bg_features = info.bg_features;
+  spl->dropped_bg_features = info.dropped_bg_features;
 
   //Get copy of label
   if(!(spl->caption = strdup(((std::string)label).c_str()))) {
@@ -107,15 +189,42 @@ void MTS_Multithreaded::cleanup(void) {
   mts_ipc_cleanup();
 }
 
+void MTS_Multithreaded::supervise(void) {
+  mts_ipc_supervise();
+}
+
 // For ctypes visibility
 extern "C" {
   unsigned char* get_img_data(void* spl);
   size_t get_height(void* spl);
   size_t get_width(void* spl);
   char* get_caption(void* spl);
+  unsigned int get_bg_features(void* spl);
+  unsigned int get_dropped_bg_features(void* spl);
   void* mts_init(const char* config_path, int num_producers);
+  void* mts_init_shared(const char* config_path, int num_producers,
+			int num_consumers);
+  void* mts_init_placed(const char* config_path, int num_producers,
+			int num_consumers, const char* producer_cpus,
+			const char* reserved_cpus, int numa_node,
+			int pin_producers);
+  void* mts_attach(const char* shared_path, int consumer);
+  void* mts_prefetch(void* mts_buff, int depth);
+  int get_shared_path(char* path, int len);
   void* get_sample(void* mts_buff);
   void free_sample(void* spl);
+  void* acquire_sample(void* mts_buff);
+  void release_sample(void* mts_buff, void* spl);
+  int get_batch(void* mts_buff, int n, int height, int max_width,
+		unsigned char* out_images, int* out_widths, char** out_labels);
+  int get_batch_float(void* mts_buff, int n, int height, int max_width,
+		      float* out_images, int* out_widths, char** out_labels);
+  void free_labels(char** labels, int n);
+  DLManagedTensor* get_sample_dlpack(void* mts_buff, char** out_caption);
+  DLManagedTensor* get_batch_dlpack(void* mts_buff, int n, int height,
+				    int max_width, int normalize,
+				    DLManagedTensor** out_widths,
+				    char** out_labels);
   void mts_cleanup(void* mts_buff);
 }
 
@@ -126,6 +235,198 @@ void free_sample(void* ptr) {
   free(s);
 }
 
+/* Nothing to share with a local synthesizer, so just hand out a copy */
+sample_t* MTS_Singlethreaded::acquire_sample(void) {
+  return get_sample();
+}
+
+void MTS_Singlethreaded::release_sample(sample_t* spl) {
+  free_sample(spl);
+}
+
+/* The sample_t is the first member of the view, so they share an address */
+sample_t* MTS_Multithreaded::acquire_sample(void) {
+  sample_view_t* view;
+  if(!(view = (sample_view_t*) malloc(sizeof(sample_view_t)))) {
+    perror("Failed to allocate sample view!\n");
+  }
+  mts_ipc_acquire_sample(view);
+  return &view->sample;
+}
+
+void MTS_Multithreaded::release_sample(sample_t* spl) {
+  sample_view_t* view = (sample_view_t*)spl;
+  mts_ipc_release_sample(view);
+  free(view);
+}
+
+/* Take heap allocated samples from buff until the batch is full */
+int fill_batch(MTS_Buffer* buff, int n, int height, int max_width,
+	       unsigned char* out_images, float* out_images_float,
+	       int* out_widths, char** out_labels) {
+  size_t slot_size = (size_t)height * max_width;
+  int skipped = 0;
+
+  // Zero padding
+  if(out_images != NULL) {
+    memset(out_images, 0, n*slot_size);
+  } else {
+    memset(out_images_float, 0, n*slot_size*sizeof(float));
+  }
+
+  for(int i = 0; i < n;) {
+    sample_t* spl = buff->get_sample();
+
+    // Samples are packed, so the stride is the width
+    sample_view_t view;
+    view.sample = *spl;
+    view.stride = spl->width;
+
+    if(ipc_copy_to_batch(&view, height, max_width,
+			 out_images ? out_images + i*slot_size : NULL,
+			 out_images ? NULL : out_images_float + i*slot_size)) {
+      out_widths[i] = (int)spl->width;
+      // Hand the label over instead of copying it
+      out_labels[i] = spl->caption;
+      spl->caption = NULL;
+      i++;
+    } else {
+      skipped++;
+    }
+
+    free_sample(spl);
+  }
+
+  return skipped;
+}
+
+/* Generate samples until the batch is full */
+int MTS_Singlethreaded::get_batch(int n, int height, int max_width,
+				  unsigned char* out_images,
+				  float* out_images_float,
+				  int* out_widths, char** out_labels) {
+  return fill_batch(this, n, height, max_width, out_images, out_images_float,
+		    out_widths, out_labels);
+}
+
+int MTS_Multithreaded::get_batch(int n, int height, int max_width,
+				 unsigned char* out_images,
+				 float* out_images_float,
+				 int* out_widths, char** out_labels) {
+  if(out_images != NULL) {
+    return mts_ipc_get_batch(n, height, max_width, out_images,
+			     out_widths, out_labels);
+  } else {
+    return mts_ipc_get_batch_float(n, height, max_width, out_images_float,
+				   out_widths, out_labels);
+  }
+}
+
+MTS_Prefetching::MTS_Prefetching(MTS_Buffer* source, int depth) {
+  this->source = source;
+  this->depth = depth >= 1 ? depth : 1;
+  this->stopping = false;
+
+  sigset_t spawn_signals;
+  sigemptyset(&spawn_signals);
+  sigaddset(&spawn_signals, SIGCHLD);
+  sigaddset(&spawn_signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &spawn_signals, &this->caller_mask);
+
+  this->worker = std::thread(&MTS_Prefetching::prefetch, this);
+}
+
+/* Worker thread: keep the queue full until stopped. Only this thread
+ * touches the source, so it needn't be thread safe. */
+void MTS_Prefetching::prefetch(void) {
+  // Supervising the producers is up to this thread now
+  sigset_t spawn_signals;
+  sigemptyset(&spawn_signals);
+  sigaddset(&spawn_signals, SIGCHLD);
+  sigaddset(&spawn_signals, SIGUSR1);
+  pthread_sigmask(SIG_UNBLOCK, &spawn_signals, NULL);
+
+  while(true) {
+    {
+      std::unique_lock<std::mutex> guard(this->lock);
+      while(!this->not_full.wait_for(guard,
+	      std::chrono::milliseconds(SUPERVISE_INTERVAL_MS), [this] {
+		return this->stopping || this->ready.size() < this->depth;
+	      })) {
+	// The queue is full, but producers still die, hang and ask to be
+	// recycled (only this thread gets their signals)
+	guard.unlock();
+	this->source->supervise();
+	guard.lock();
+      }
+      if(this->stopping) {
+	return;
+      }
+    }
+
+    // Generate without holding the lock
+    sample_t* spl = this->source->get_sample();
+
+    {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->ready.push_back(spl);
+    }
+    this->not_empty.notify_one();
+  }
+}
+
+/* Next prefetched sample, waiting for the worker if there is none */
+sample_t* MTS_Prefetching::get_sample(void) {
+  sample_t* spl;
+  {
+    std::unique_lock<std::mutex> guard(this->lock);
+    this->not_empty.wait(guard, [this] { return !this->ready.empty(); });
+    spl = this->ready.front();
+    this->ready.pop_front();
+  }
+  this->not_full.notify_one();
+  return spl;
+}
+
+/* Prefetched samples are already copies */
+sample_t* MTS_Prefetching::acquire_sample(void) {
+  return get_sample();
+}
+
+void MTS_Prefetching::release_sample(sample_t* spl) {
+  free_sample(spl);
+}
+
+int MTS_Prefetching::get_batch(int n, int height, int max_width,
+			       unsigned char* out_images,
+			       float* out_images_float,
+			       int* out_widths, char** out_labels) {
+  return fill_batch(this, n, height, max_width, out_images, out_images_float,
+		    out_widths, out_labels);
+}
+
+/* Stop the worker (once its current sample is done), then the source, and
+ * restore the signal mask the creating thread had (cleanup is normally
+ * called on that thread too) */
+void MTS_Prefetching::cleanup(void) {
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->stopping = true;
+  }
+  this->not_full.notify_one();
+  this->worker.join();
+
+  for(sample_t* spl : this->ready) {
+    free_sample(spl);
+  }
+  this->ready.clear();
+
+  this->source->cleanup();
+  delete this->source;
+
+  pthread_sigmask(SIG_SETMASK, &this->caller_mask, NULL);
+}
+
 unsigned char* get_img_data(void* ptr) {
   return ((sample_t*)ptr)->img_data;
 }
@@ -138,6 +439,12 @@ size_t get_width(void* ptr) {
 char* get_caption(void* ptr) {
   return ((sample_t*)ptr)->caption;
 }
+unsigned int get_bg_features(void* ptr) {
+  return ((sample_t*)ptr)->bg_features;
+}
+unsigned int get_dropped_bg_features(void* ptr) {
+  return ((sample_t*)ptr)->dropped_bg_features;
+}
 
 /* Get a sample */
 void* get_sample(void* mts_buff_arg) {
@@ -146,6 +453,116 @@ void* get_sample(void* mts_buff_arg) {
   return ret;
 }
 
+/* Get a sample without copying it out of shared memory */
+void* acquire_sample(void* mts_buff) {
+  return ((MTS_Buffer*)mts_buff)->acquire_sample();
+}
+
+/* Give back a sample from acquire_sample */
+void release_sample(void* mts_buff, void* spl) {
+  ((MTS_Buffer*)mts_buff)->release_sample((sample_t*)spl);
+}
+
+/* Fill a zero-padded uint8 batch, returns number of skipped samples */
+int get_batch(void* mts_buff, int n, int height, int max_width,
+	      unsigned char* out_images, int* out_widths, char** out_labels) {
+  return ((MTS_Buffer*)mts_buff)->get_batch(n, height, max_width, out_images,
+					    NULL, out_widths, out_labels);
+}
+
+/* Fill a zero-padded float batch, returns number of skipped samples */
+int get_batch_float(void* mts_buff, int n, int height, int max_width,
+		    float* out_images, int* out_widths, char** out_labels) {
+  return ((MTS_Buffer*)mts_buff)->get_batch(n, height, max_width, NULL,
+					    out_images, out_widths,
+					    out_labels);
+}
+
+/* A DLPack tensor owning its malloc'ed data */
+struct MTS_DLTensor {
+  DLManagedTensor managed;
+  int64_t shape[4];
+};
+
+void free_dlpack_tensor(DLManagedTensor* managed) {
+  free(managed->dl_tensor.data);
+  delete (MTS_DLTensor*)managed->manager_ctx;
+}
+
+DLManagedTensor* new_dlpack_tensor(void* data, int ndim, const int64_t* shape,
+				   uint8_t code, uint8_t bits) {
+  MTS_DLTensor* tensor = new MTS_DLTensor();
+  memcpy(tensor->shape, shape, ndim*sizeof(int64_t));
+
+  DLTensor* dl_tensor = &tensor->managed.dl_tensor;
+  dl_tensor->data = data;
+  dl_tensor->device.device_type = kDLCPU;
+  dl_tensor->device.device_id = 0;
+  dl_tensor->ndim = ndim;
+  dl_tensor->dtype.code = code;
+  dl_tensor->dtype.bits = bits;
+  dl_tensor->dtype.lanes = 1;
+  dl_tensor->shape = tensor->shape;
+  dl_tensor->strides = NULL;
+  dl_tensor->byte_offset = 0;
+
+  tensor->managed.manager_ctx = tensor;
+  tensor->managed.deleter = free_dlpack_tensor;
+  return &tensor->managed;
+}
+
+/* Next sample as a [height, width, 1] uint8 DLPack tensor that takes over
+ * its image, with a heap allocated copy of its caption in out_caption.
+ * Samples always come out of shared memory first: a framework may hold on
+ * to a tensor indefinitely, which must not keep ring space from the
+ * producers. */
+DLManagedTensor* get_sample_dlpack(void* mts_buff, char** out_caption) {
+  sample_t* spl = ((MTS_Buffer*)mts_buff)->get_sample();
+  int64_t shape[3] = { (int64_t)spl->height, (int64_t)spl->width, 1 };
+  DLManagedTensor* tensor = new_dlpack_tensor(spl->img_data, 3, shape,
+					      kDLUInt, 8);
+  *out_caption = spl->caption;
+  free(spl);
+  return tensor;
+}
+
+/* Like get_batch(_float), as a [n, height, max_width, 1] uint8 (float32 if
+ * normalize) DLPack tensor, with the widths as an [n] int32 one in
+ * out_widths. Returns NULL if they can't be allocated. */
+DLManagedTensor* get_batch_dlpack(void* mts_buff, int n, int height,
+				  int max_width, int normalize,
+				  DLManagedTensor** out_widths,
+				  char** out_labels) {
+  size_t elem_size = normalize ? sizeof(float) : sizeof(unsigned char);
+  void* images = malloc((size_t)n * height * max_width * elem_size);
+  int* widths = (int*)malloc(n*sizeof(int));
+  if(images == NULL || widths == NULL) {
+    perror("Failed to allocate batch!\n");
+    free(images);
+    free(widths);
+    return NULL;
+  }
+
+  ((MTS_Buffer*)mts_buff)->get_batch(n, height, max_width,
+				     normalize ? NULL : (unsigned char*)images,
+				     normalize ? (float*)images : NULL,
+				     widths, out_labels);
+
+  int64_t width_shape[1] = { n };
+  *out_widths = new_dlpack_tensor(widths, 1, width_shape, kDLInt,
+				  8*sizeof(int));
+  int64_t image_shape[4] = { n, height, max_width, 1 };
+  return new_dlpack_tensor(images, 4, image_shape,
+			   normalize ? kDLFloat : kDLUInt, 8*elem_size);
+}
+
+/* Free the labels filled in by get_batch */
+void free_labels(char** labels, int n) {
+  for(int i = 0; i < n; i++) {
+    free(labels[i]);
+  }
+}
+
 /* Called before using python generator function */
 void* mts_init(const char* config_path, int num_threads) {
   if(num_threads >= 1) {
@@ -155,8 +572,58 @@ void* mts_init(const char* config_path, int num_threads) {
   }
 }
 
+/* Like mts_init, but with producers shared by num_consumers processes,
+ * this one being consumer 0 */
+void* mts_init_shared(const char* config_path, int num_threads,
+		      int num_consumers) {
+  return (void*)new MTS_Multithreaded(config_path, num_threads,
+				      num_consumers);
+}
+
+/* Like mts_init_shared, with producers kept to producer_cpus (NULL: any),
+ * off reserved_cpus (NULL: none) and, along with the shared buffer, on
+ * numa_node (-1: any), each pinned to a CPU if pin_producers */
+void* mts_init_placed(const char* config_path, int num_threads,
+		      int num_consumers, const char* producer_cpus,
+		      const char* reserved_cpus, int numa_node,
+		      int pin_producers) {
+  mts_ipc_opts_t opts;
+  mts_ipc_default_opts(&opts);
+  opts.num_producers = num_threads;
+  opts.num_consumers = num_consumers;
+  opts.config_file = config_path;
+  opts.producer_cpus = producer_cpus;
+  opts.reserved_cpus = reserved_cpus;
+  opts.producer_node = numa_node;
+  opts.shm_node = numa_node;
+  opts.pin_producers = pin_producers;
+  return (void*)new MTS_Multithreaded(&opts);
+}
+
+/* Use the producers of another process (mts_init_shared, passing on its
+ * get_shared_path) as consumer, returns NULL on failure */
+void* mts_attach(const char* shared_path, int consumer) {
+  if(!mts_ipc_attach(shared_path, consumer)) {
+    return NULL;
+  }
+  return (void*)new MTS_Multithreaded();
+}
+
+/* Wrap a buffer from mts_init* or mts_attach, so that its samples are
+ * generated (or copied out of shared memory) on a background thread, up to
+ * depth of them ahead of the caller. The wrapper owns the buffer, and
+ * hands out heap allocated samples only. */
+void* mts_prefetch(void* mts_buff, int depth) {
+  return (void*)new MTS_Prefetching((MTS_Buffer*)mts_buff, depth);
+}
+
+/* Path other consumers attach to, returns its length */
+int get_shared_path(char* path, int len) {
+  return mts_ipc_shared_path(path, len);
+}
+
 /* Called after using python generator function */
 void mts_cleanup(void* mts) {
   ((MTS_Buffer*)mts)->cleanup();
-  free(mts);
+  delete (MTS_Buffer*)mts;
 }